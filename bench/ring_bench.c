@@ -0,0 +1,108 @@
+// Runs bench/rings.cpp under simavr and writes out how many cycles each of its
+// cases takes, per byte, for SpscRing next to ring_span.
+//
+// usage: ring_bench rings.elf results.json
+//
+// The firmware writes a case's number to GPIOR0 when it starts and 0 when it's
+// done, and the time between those is the case. The marks themselves are
+// timed by an empty case and taken back out.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+
+#define F_CPU 1000000
+#define GPIOR0_ADDRESS 0x3e
+// bytes each case moves, the size of the I2C buffers
+#define CASE_BYTES 64
+// the whole firmware is a few thousand cycles
+#define TIMEOUT_CYCLES 1000000
+
+// in the same order as Case in bench/rings.cpp, starting at 1
+static const struct {
+  const char *ring;
+  const char *operation;
+} cases[] = {
+    {"none", "nothing"},        {"spsc_ring", "push_back"},
+    {"spsc_ring", "pop_front"}, {"spsc_ring", "clear"},
+    {"spsc_ring", "push"},      {"spsc_ring", "pop"},
+    {"ring_span", "push_back"}, {"ring_span", "pop_front"},
+    {"ring_span", "clear"},
+};
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+static avr_cycle_count_t cycles[CASE_COUNT];
+static uint8_t running;
+static avr_cycle_count_t started;
+
+static void on_mark(struct avr_t *avr, avr_io_addr_t addr, uint8_t value,
+                    void *param) {
+  (void)addr;
+  (void)param;
+  if (value != 0) {
+    running = value;
+    started = avr->cycle;
+  } else if (running != 0 && running <= CASE_COUNT) {
+    cycles[running - 1] = avr->cycle - started;
+    running = 0;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s rings.elf results.json\n", argv[0]);
+    return 1;
+  }
+  elf_firmware_t firmware = {0};
+  if (elf_read_firmware(argv[1], &firmware) != 0) {
+    fprintf(stderr, "couldn't read %s\n", argv[1]);
+    return 1;
+  }
+  avr_t *avr = avr_make_mcu_by_name("atmega328p");
+  if (!avr) {
+    fprintf(stderr, "simavr doesn't know the atmega328p\n");
+    return 1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = F_CPU;
+  avr->log = LOG_ERROR;
+  avr_register_io_write(avr, GPIOR0_ADDRESS, on_mark, NULL);
+
+  int state = cpu_Running;
+  while (state != cpu_Done && state != cpu_Crashed) {
+    if (avr->cycle > TIMEOUT_CYCLES) {
+      fprintf(stderr, "firmware never finished\n");
+      return 1;
+    }
+    state = avr_run(avr);
+  }
+  if (state == cpu_Crashed) {
+    fprintf(stderr, "firmware crashed at cycle %llu\n",
+            (unsigned long long)avr->cycle);
+    return 1;
+  }
+
+  FILE *out = fopen(argv[2], "w");
+  if (!out) {
+    fprintf(stderr, "couldn't write %s\n", argv[2]);
+    return 1;
+  }
+  avr_cycle_count_t overhead = cycles[0];
+  fprintf(out, "{\n  \"f_cpu\": %d,\n  \"bytes\": %d,\n  \"cases\": [\n", F_CPU,
+          CASE_BYTES);
+  for (size_t i = 1; i != CASE_COUNT; i++) {
+    avr_cycle_count_t taken = cycles[i] > overhead ? cycles[i] - overhead : 0;
+    fprintf(out,
+            "    {\"ring\": \"%s\", \"operation\": \"%s\", \"cycles\": %llu, "
+            "\"per_byte\": %.2f}%s\n",
+            cases[i].ring, cases[i].operation, (unsigned long long)taken,
+            (double)taken / CASE_BYTES, i + 1 == CASE_COUNT ? "" : ",");
+  }
+  fprintf(out, "  ]\n}\n");
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,96 @@
+// Pushes and pops the same bytes through SpscRing and through ring_span, for
+// bench/ring_bench.c to time under simavr. Each case is marked by writing its
+// number to GPIOR0 before it starts and 0 once it's done.
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "nonstd/ring_span.hpp"
+#include "spsc_ring.hpp"
+
+namespace {
+// the I2C buffers
+constexpr uint8_t capacity = 64;
+
+// in the same order as cases in bench/ring_bench.c
+enum Case : uint8_t {
+  done,
+  nothing,
+  spsc_push_back,
+  spsc_pop_front,
+  spsc_clear,
+  spsc_push,
+  spsc_pop,
+  span_push_back,
+  span_pop_front,
+  span_clear,
+};
+
+SpscRing<capacity> spsc;
+std::array<uint8_t, capacity> span_raw;
+nonstd::ring_span<uint8_t> span(span_raw.begin(), span_raw.end());
+std::array<uint8_t, capacity> bulk;
+volatile uint8_t sink;
+
+// Nothing the case does can be moved past the marks.
+template <typename F> void measure(Case which, F &&f) {
+  asm volatile("" ::: "memory");
+  GPIOR0 = which;
+  asm volatile("" ::: "memory");
+  f();
+  asm volatile("" ::: "memory");
+  GPIOR0 = done;
+  asm volatile("" ::: "memory");
+}
+
+// every byte the I2c buffers see in a full length write
+void fill_spsc() {
+  for (uint8_t i = 0; i != capacity; i++) {
+    spsc.push_back(i);
+  }
+}
+void fill_span() {
+  for (uint8_t i = 0; i != capacity; i++) {
+    span.push_back(i);
+  }
+}
+} // namespace
+
+int main() {
+  measure(nothing, [] {});
+
+  measure(spsc_push_back, fill_spsc);
+  measure(spsc_pop_front, [] {
+    uint8_t sum = 0;
+    while (!spsc.empty()) {
+      sum += spsc.pop_front();
+    }
+    sink = sum;
+  });
+  fill_spsc();
+  measure(spsc_clear, [] { spsc.clear(); });
+  measure(spsc_push, [] { spsc.push(bulk); });
+  measure(spsc_pop, [] { spsc.pop(bulk); });
+
+  measure(span_push_back, fill_span);
+  measure(span_pop_front, [] {
+    uint8_t sum = 0;
+    while (!span.empty()) {
+      sum += span.pop_front();
+    }
+    sink = sum;
+  });
+  fill_span();
+  // what I2c did before it had clear
+  measure(span_clear, [] {
+    while (!span.empty()) {
+      span.pop_front();
+    }
+  });
+
+  // simavr stops on sleeping with interrupts off
+  cli();
+  sleep_enable();
+  sleep_cpu();
+}
@@ -0,0 +1,268 @@
+// Runs the servo firmware under simavr with a scripted TWI master, and writes
+// out how many cycles the TWI interrupt takes for each I2cStatus, and how many
+// transactions a second get through at 100 kHz and 400 kHz.
+//
+// usage: twi_bench main.elf results.json
+//
+// The master talks to simavr's TWI in slave mode: it raises START together
+// with ADDR as one message, then WRITE and READ, on the TWI input irq, ends
+// every byte it reads with an ACK (data 1) or a NACK (data 0), and the
+// firmware answers on the output irq once its interrupt releases the clock.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "avr_twi.h"
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+
+#define F_CPU 1000000
+// init_i2c's default
+#define SLAVE_ADDRESS 0xfe
+#define TWI_VECTOR 24
+#define VECTOR_SIZE 4
+#define TWSR_ADDRESS 0xb9
+// past this the firmware isn't answering at all
+#define TIMEOUT_CYCLES 20000
+#define TRANSACTIONS 200
+
+static const struct {
+  uint8_t status;
+  const char *name;
+} statuses[] = {
+    {0x60, "start_sr"}, {0x70, "start_gen"}, {0x80, "ack_sr"},
+    {0x88, "nack_sr"},  {0x90, "ack_gen"},   {0x98, "nack_gen"},
+    {0xa0, "stop_sr"},  {0xa8, "start_st"},  {0xb8, "ack_st"},
+    {0xc0, "nack_st"},  {0xc8, "stop_st_err"},
+};
+#define STATUS_COUNT (sizeof(statuses) / sizeof(statuses[0]))
+
+struct isr_stats {
+  uint32_t count;
+  uint64_t total;
+  uint32_t worst;
+};
+
+static struct isr_stats isr[STATUS_COUNT];
+static avr_t *avr;
+static avr_irq_t *twi_input;
+
+static bool in_isr;
+static uint8_t isr_status;
+static avr_cycle_count_t isr_start;
+static uint32_t isr_exits;
+
+static bool answered;
+
+static double cycles_per_bit;
+// cycles the firmware held the clock for
+static avr_cycle_count_t stretched;
+
+static void on_answer(struct avr_irq_t *irq, uint32_t value, void *param) {
+  (void)irq;
+  (void)value;
+  (void)param;
+  answered = true;
+}
+
+static void record(uint8_t status, uint32_t cycles) {
+  for (size_t i = 0; i != STATUS_COUNT; i++) {
+    if (statuses[i].status != status)
+      continue;
+    isr[i].count++;
+    isr[i].total += cycles;
+    if (cycles > isr[i].worst)
+      isr[i].worst = cycles;
+    return;
+  }
+}
+
+// One instruction, or one sleep, at a time. An interrupt counts from its
+// vector until interrupts are back on, which is the reti.
+static void step(void) {
+  int state = avr_run(avr);
+  if (state == cpu_Done || state == cpu_Crashed) {
+    fprintf(stderr, "firmware stopped at cycle %llu\n",
+            (unsigned long long)avr->cycle);
+    exit(1);
+  }
+  if (!in_isr && avr->pc == TWI_VECTOR * VECTOR_SIZE) {
+    in_isr = true;
+    isr_status = avr->data[TWSR_ADDRESS] & 0xf8;
+    isr_start = avr->cycle;
+  } else if (in_isr && avr->sreg[S_I]) {
+    in_isr = false;
+    isr_exits++;
+    record(isr_status, avr->cycle - isr_start);
+  }
+}
+
+static void run_for(avr_cycle_count_t cycles) {
+  avr_cycle_count_t until = avr->cycle + cycles;
+  while (avr->cycle < until)
+    step();
+}
+
+// The firmware keeps running while bits go by on the bus.
+static void bus_bits(double bits) {
+  run_for((avr_cycle_count_t)(bits * cycles_per_bit + 0.5));
+}
+
+// what a bus event waits on before the master carries on
+enum { none = 0, answer = 1, interrupt = 2 };
+
+// Raises one bus event, then holds the bus until the firmware has dealt with
+// it: the slave interrupt has run, or the slave answered, or both.
+static void send(uint8_t msg, uint8_t addr, uint8_t data, int wait) {
+  uint32_t exits = isr_exits;
+  avr_cycle_count_t start = avr->cycle;
+  answered = false;
+  avr_raise_irq(twi_input, avr_twi_irq_msg(msg, addr, data));
+  while (((wait & answer) && !answered) ||
+         ((wait & interrupt) && (isr_exits == exits || in_isr))) {
+    if (avr->cycle - start > TIMEOUT_CYCLES) {
+      fprintf(stderr, "no answer to bus event 0x%x\n", msg);
+      exit(1);
+    }
+    step();
+  }
+  stretched += avr->cycle - start;
+}
+
+// simavr's slave only matches the address when it comes in the same message
+// as the start, so the start bit and the address byte go by first.
+static void start(uint8_t rw) {
+  bus_bits(10);
+  send(TWI_COND_START | TWI_COND_ADDR, SLAVE_ADDRESS | rw, 0,
+       answer | interrupt);
+}
+
+// A stop only interrupts a slave that was being written to.
+static void stop(int wait) {
+  bus_bits(1);
+  send(TWI_COND_STOP, SLAVE_ADDRESS, 0, wait);
+}
+
+static void write_register(uint8_t reg, const uint8_t *data, uint8_t size) {
+  start(0);
+  bus_bits(9);
+  send(TWI_COND_WRITE, SLAVE_ADDRESS, reg, answer | interrupt);
+  for (uint8_t i = 0; i != size; i++) {
+    bus_bits(9);
+    send(TWI_COND_WRITE, SLAVE_ADDRESS, data[i], answer | interrupt);
+  }
+  stop(interrupt);
+}
+
+static void read_register(uint8_t reg, uint8_t size) {
+  start(0);
+  bus_bits(9);
+  send(TWI_COND_WRITE, SLAVE_ADDRESS, reg, answer | interrupt);
+  // the repeated start interrupts with stop_sr, which ends the write
+  start(1);
+  for (uint8_t i = 0; i != size; i++) {
+    // the byte is already in TWDR, the ack or nack is what interrupts
+    bus_bits(8);
+    send(TWI_COND_READ, SLAVE_ADDRESS | 1, 0, answer);
+    bus_bits(1);
+    send(TWI_COND_ACK, SLAVE_ADDRESS | 1, i + 1 != size, interrupt);
+  }
+  stop(none);
+}
+
+struct throughput {
+  const char *transaction;
+  uint32_t scl_hz;
+  double per_second;
+  double stretch_per_transaction;
+};
+
+static struct throughput measure(const char *name, uint32_t scl_hz,
+                                 void (*transaction)(void)) {
+  cycles_per_bit = (double)F_CPU / scl_hz;
+  stretched = 0;
+  avr_cycle_count_t begin = avr->cycle;
+  for (int i = 0; i != TRANSACTIONS; i++)
+    transaction();
+  double seconds = (double)(avr->cycle - begin) / F_CPU;
+  return (struct throughput){name, scl_hz, TRANSACTIONS / seconds,
+                             (double)stretched / TRANSACTIONS};
+}
+
+// the telemetry block, 4 floats and the mode
+static void read_telemetry(void) { read_register('b', 17); }
+
+static void write_setpoint(void) {
+  static const uint8_t setpoint[4] = {0x00, 0x00, 0x34, 0x42};
+  write_register('s', setpoint, sizeof(setpoint));
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s firmware.elf results.json\n", argv[0]);
+    return 1;
+  }
+  elf_firmware_t firmware = {0};
+  if (elf_read_firmware(argv[1], &firmware) != 0) {
+    fprintf(stderr, "couldn't read %s\n", argv[1]);
+    return 1;
+  }
+  avr = avr_make_mcu_by_name("atmega328p");
+  if (!avr) {
+    fprintf(stderr, "simavr doesn't know the atmega328p\n");
+    return 1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = F_CPU;
+  avr->log = LOG_ERROR;
+
+  twi_input = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT);
+  avr_irq_register_notify(
+      avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), on_answer,
+      NULL);
+
+  // past init, and a full set of read responses rendered
+  run_for(F_CPU / 10);
+
+  struct throughput results[] = {
+      measure("read b", 100000, read_telemetry),
+      measure("write s", 100000, write_setpoint),
+      measure("read b", 400000, read_telemetry),
+      measure("write s", 400000, write_setpoint),
+  };
+
+  FILE *out = fopen(argv[2], "w");
+  if (!out) {
+    fprintf(stderr, "couldn't write %s\n", argv[2]);
+    return 1;
+  }
+  fprintf(out, "{\n  \"f_cpu\": %d,\n  \"isr_cycles\": {\n", F_CPU);
+  bool first = true;
+  for (size_t i = 0; i != STATUS_COUNT; i++) {
+    if (isr[i].count == 0)
+      continue;
+    fprintf(out,
+            "%s    \"%s\": {\"status\": %u, \"count\": %u, \"worst\": %u, "
+            "\"mean\": %.1f}",
+            first ? "" : ",\n", statuses[i].name, statuses[i].status,
+            isr[i].count, isr[i].worst, (double)isr[i].total / isr[i].count);
+    first = false;
+  }
+  fprintf(out, "\n  },\n  \"throughput\": [\n");
+  size_t result_count = sizeof(results) / sizeof(results[0]);
+  for (size_t i = 0; i != result_count; i++) {
+    fprintf(out,
+            "    {\"transaction\": \"%s\", \"scl_hz\": %u, "
+            "\"per_second\": %.1f, \"stretch_cycles\": %.1f}%s\n",
+            results[i].transaction, results[i].scl_hz, results[i].per_second,
+            results[i].stretch_per_transaction,
+            i + 1 == result_count ? "" : ",");
+  }
+  fprintf(out, "  ]\n}\n");
+  fclose(out);
+  return 0;
+}
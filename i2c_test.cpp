@@ -11,7 +11,7 @@ std::vector<I2cStatus> statuses;
 auto i2c = I2c(
     [](uint8_t addr, auto &output) {
       out_addr = addr;
-      std::copy(output.begin(), output.end(), out.data());
+      output.pop(out);
       has_written = true;
     },
     [](uint8_t addr, auto &input) {
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "spsc_ring.hpp"
+
+// One current loop tick, kept in the units the loop already has them in so
+// recording is just copies.
+struct CaptureSample {
+  // low 16 bits of the tick's timestamp in microseconds
+  uint16_t time;
+  // 12.4 degrees, straight from the TMAG
+  uint16_t angle;
+  // 12.4 degrees per second
+  int16_t velocity;
+  // raw IPROPI ADC counts
+  uint16_t current;
+  // motor duty, 1.15
+  int16_t output;
+};
+
+// Records current loop samples into a ring for the master to drain in pages.
+// The loop is the producer and the I2C interrupt the consumer. If the ring
+// fills up, new samples are dropped and
+// counted rather than overwriting ones that haven't been read, so whatever
+// does come out is gap free.
+template <uint8_t Size, uint8_t PageSamples> class Capture {
+public:
+  enum Trigger : uint8_t {
+    // stops capturing, what's already in the ring can still be read
+    off,
+    now,
+    // the next setpoint, mode or move, to catch a step response from its start
+    setpoint,
+  };
+
+  static constexpr uint8_t page_size = 2 + PageSamples * sizeof(CaptureSample);
+
+  // keeps every decimation'th sample, 0 counts as 1
+  void configure(Trigger trigger, uint8_t decimation) noexcept {
+    keep_every = decimation == 0 ? 1 : decimation;
+    countdown = 1;
+    state = trigger == now ? running : trigger == setpoint ? armed : stopped;
+  }
+  void setpoint_changed() noexcept {
+    if (state == armed)
+      state = running;
+  }
+  bool recording() const noexcept { return state == running; }
+
+  void record(CaptureSample const &sample) noexcept {
+    if (--countdown != 0)
+      return;
+    countdown = keep_every;
+    if (!samples.push_back(sample))
+      dropped = dropped + 1;
+  }
+
+  // {count, dropped since the last page, samples...}. Takes the samples out
+  // of the ring, so a read that gets cut short loses them.
+  std::span<uint8_t const> drain() noexcept {
+    uint8_t count = samples.size();
+    if (count > PageSamples)
+      count = PageSamples;
+    uint8_t dropped_now = dropped;
+    page[0] = count;
+    page[1] = dropped_now - reported;
+    reported = dropped_now;
+    for (uint8_t i = 0; i != count; i++) {
+      CaptureSample sample = samples.pop_front();
+      std::memcpy(&page[2 + i * sizeof(CaptureSample)], &sample,
+                  sizeof(CaptureSample));
+    }
+    return std::span(page).first(2 + count * sizeof(CaptureSample));
+  }
+
+private:
+  enum State : uint8_t { stopped, armed, running };
+
+  SpscRing<Size, CaptureSample> samples;
+  volatile State state = stopped;
+  volatile uint8_t keep_every = 1;
+  uint8_t countdown = 1;
+  // counted by the loop, and by the interrupt for what it already reported
+  volatile uint8_t dropped = 0;
+  uint8_t reported = 0;
+  std::array<uint8_t, page_size> page{};
+};
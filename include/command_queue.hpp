@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+#include "i2c.hpp"
+#include "spsc_ring.hpp"
+
+// Register writes from the TWI interrupt, held for the loop to apply between
+// updates. Frames are {address, general, length, bytes...} in an SpscRing, and
+// the loop only takes a frame once all of it is in.
+template <uint8_t Capacity> class CommandQueue {
+  static constexpr uint8_t header = 3;
+  static_assert(Capacity >= buffer_span::capacity() + header,
+                "has to fit a whole I2C write");
+
+public:
+  // For the TWI interrupt. A write that doesn't fit is dropped whole.
+  bool push(uint8_t address, buffer_span &data,
+            bool general = false) noexcept {
+    uint8_t size = data.size();
+    if (Capacity - bytes.size() < size + header)
+      return false;
+    bytes.push_back(address);
+    bytes.push_back(general);
+    bytes.push_back(size);
+    for (uint8_t i = 0; i != size; i++) {
+      bytes.push_back(data[i]);
+    }
+    return true;
+  }
+
+  // Calls f(address, data, general) for every frame that was in when it
+  // started, oldest first.
+  template <typename F> void drain(F &&f) noexcept {
+    uint8_t left = bytes.size();
+    while (left >= header && left - header >= bytes[2]) {
+      uint8_t address = bytes.pop_front();
+      bool general = bytes.pop_front();
+      uint8_t size = bytes.pop_front();
+      buffer_span data;
+      for (uint8_t i = 0; i != size; i++) {
+        data.push_back(bytes.pop_front());
+      }
+      left -= header + size;
+      f(address, data, general);
+    }
+  }
+
+private:
+  SpscRing<Capacity> bytes;
+};
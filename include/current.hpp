@@ -3,6 +3,7 @@
 #include <avr/io.h>
 #include <avr/sfr_defs.h>
 
+#include "fixed.hpp"
 #include "set_reg.hpp"
 
 inline void init_adc() {
@@ -21,6 +22,11 @@ inline uint16_t get_analog_raw(uint8_t pin) {
   return result;
 }
 
-inline float get_analog(uint8_t pin) {
-  return float(get_analog_raw(pin) * 5) / 1024;
+inline float adc_volts(uint16_t raw) { return float(raw * 5) / 1024; }
+// The same for the loops. 5 V over 10 bits is a whole 320 in 16.16, so it's
+// exact without any float math.
+inline q16_16 adc_volts_fixed(uint16_t raw) noexcept {
+  return q16_16::from_raw((int32_t(raw) * 5) << (16 - 10));
 }
+
+inline float get_analog(uint8_t pin) { return adc_volts(get_analog_raw(pin)); }
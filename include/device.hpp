@@ -1,58 +1,345 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <cstdio>
 
-#include "pid.hpp"
+#include "capture.hpp"
+#include "current.hpp"
+#include "gain_schedule.hpp"
+#include "observer.hpp"
+#include "pid_controller.hpp"
+#include "profile.hpp"
 
+// Cascaded position -> velocity -> current control. The current loop runs
+// every control tick, the outer loops only every few ticks. The mode picks
+// which loop gets the external setpoint, and the loops outside of it are left
+// idle.
 struct DeviceState {
   enum Mode : uint8_t { position, velocity, current };
 
-  float get_angle() const noexcept { return current_loc / float(1 << 4); }
-  float get_vel() const noexcept {
-    return (current_loc - prev_loc) / float(1 << 4);
-  }
-  float get_current() const noexcept { return dev_current; }
-  float get_setpoint() const noexcept { return pid().getSetpoint(); }
-  float get_P() const noexcept { return pid().P; }
-  float get_I() const noexcept { return pid().I; }
-  float get_D() const noexcept { return pid().D; }
-  float get_F() const noexcept { return pid().F; }
-  void set_P(float p) noexcept { return pid().setP(p); }
-  void set_I(float i) noexcept { return pid().setI(i); }
-  void set_D(float d) noexcept { return pid().setD(d); }
-  void set_F(float f) noexcept { return pid().setF(f); }
+  using Schedule = GainSchedule<q16_16, 4>;
+  // about 64 ms of samples at full rate, drained 8 at a time
+  using Recorder = Capture<16, 8>;
 
-  void update_loc(uint16_t value) noexcept {
-    prev_loc = current_loc;
-    current_loc = value;
+  // 2000 cycles at 1 MHz, about as long as timer2 can pace. Nothing has
+  // measured a full tick fitting in 1000 yet, so shorten this only once `o`
+  // stays at 0 and `w` shows the room for it.
+  static constexpr uint32_t tick_us = 2000;
+  // in ticks of the current loop, 16 and 32 ms
+  static constexpr uint8_t velocity_divider = 8;
+  static constexpr uint8_t position_divider = 16;
+  static constexpr float velocity_period =
+      tick_us * velocity_divider / 1000000.f;
+  static constexpr int32_t ticks_per_second = 1000000 / tick_us;
+
+  // 12.4, like the TMAG's angles
+  static constexpr int16_t full_turn = 360 << 4;
+
+  // What I2C reads get rendered from, as of the last publish().
+  struct Snapshot {
+    uint16_t loc;
+    int32_t total_loc;
+    int32_t turns;
+    q16_16 vel;
+    // IPROPI volts
+    q16_16 current;
+    uint16_t current_raw;
+    q16_16 setpoint;
+    Mode mode;
+    q16_16 P, I, D, F;
+  };
+
+  // These all read the last published snapshot.
+  // degrees, counting whole turns since start()
+  float get_angle() const noexcept {
+    return snapshot().total_loc / float(1 << 4);
+  }
+  int32_t get_turns() const noexcept { return snapshot().turns; }
+  // degrees per second
+  float get_vel() const noexcept { return snapshot().vel.to_float(); }
+  float get_current() const noexcept { return snapshot().current.to_float(); }
+  float get_setpoint() const noexcept {
+    return snapshot().setpoint.to_float();
+  }
+  // The same again without any floats, for the compact registers. Angle and
+  // velocity are 12.4, current is raw ADC counts, and the setpoint is 12.4 in
+  // degrees or 4.12 in volts depending on the mode. The angle is only the one
+  // within the turn.
+  uint16_t get_angle_fixed() const noexcept { return snapshot().loc; }
+  int16_t get_vel_fixed() const noexcept {
+    return q12_4::from_frac<16>(snapshot().vel.raw).raw;
+  }
+  uint16_t get_current_raw() const noexcept { return snapshot().current_raw; }
+  int16_t get_setpoint_fixed() const noexcept {
+    Snapshot const &s = snapshot();
+    if (s.mode == current)
+      return q4_12::from_frac<16>(s.setpoint.raw).raw;
+    return q12_4::from_frac<16>(s.setpoint.raw).raw;
+  }
+  Mode get_mode() const noexcept { return snapshot().mode; }
+  float get_P() const noexcept { return snapshot().P.to_float(); }
+  float get_I() const noexcept { return snapshot().I.to_float(); }
+  float get_D() const noexcept { return snapshot().D.to_float(); }
+  float get_F() const noexcept { return snapshot().F.to_float(); }
+  // While the loop is scheduled these only change what it goes back to once
+  // the schedule is off.
+  void set_P(float p) noexcept {
+    if (scheduled(mode))
+      configured[mode].P = q16_16(p);
+    else
+      pid().set_P(p);
   }
-  void set_current(float f) noexcept { dev_current = f; }
+  void set_I(float i) noexcept {
+    if (scheduled(mode))
+      configured[mode].I = q16_16(i);
+    else
+      pid().set_I(i);
+  }
+  void set_D(float d) noexcept {
+    if (scheduled(mode))
+      configured[mode].D = q16_16(d);
+    else
+      pid().set_D(d);
+  }
+  void set_F(float f) noexcept { return pid().set_F(f); }
 
-  float get_output() noexcept {
-    float metric = 0;
-    switch (mode) {
-    case position:
-      metric = get_angle();
-      break;
-    case velocity:
-      metric = get_vel();
+  // Schedules are per loop, not per mode, so the inner loops of the cascade
+  // can be scheduled as well. While one is active it overrides P, I and D,
+  // and the gains set through p, i and d are kept aside until it's off.
+  void set_schedule_point(Mode loop, uint8_t index, float x, float p, float i,
+                          float d) noexcept {
+    schedules[loop].set_point(index, q16_16(x),
+                              {q16_16(p), q16_16(i), q16_16(d)});
+  }
+  void set_schedule(Mode loop, Schedule::Source source,
+                    uint8_t size) noexcept {
+    PID &loop_pid = pid(loop);
+    if (!scheduled(loop))
+      configured[loop] = {loop_pid.P, loop_pid.I, loop_pid.D};
+    schedules[loop].commit(source, size);
+    if (scheduled(loop))
+      return;
+    Schedule::Gains const &gains = configured[loop];
+    loop_pid.set_gains(gains.P, gains.I, gains.D);
+    // the I limit is per I gain
+    loop_pid.set_max_i_output(loop_pid.max_i_output);
+  }
+
+  // Runs a profiled move in position mode. The profile steps at the velocity
+  // loop rate, feeding the position setpoint and a velocity feed-forward.
+  // Units are degrees and seconds.
+  void start_move(float target, float max_vel, float max_acc,
+                  float max_jerk) noexcept {
+    float from = pid().get_setpoint().to_float(), from_vel = profile.velocity;
+    if (mode != position) {
+      from = total_loc / float(1 << 4);
+      from_vel = vel.to_float();
+      transition_state(position, from);
+    }
+    profile.start(from, from_vel, target, max_vel, max_acc, max_jerk);
+    recorder.setpoint_changed();
+  }
+
+  // Staged targets wait for latch(), which a general call broadcast triggers
+  // on every servo at once. Staging again replaces what was there.
+  void stage_setpoint(float setpoint) noexcept {
+    staged = staged_setpoint;
+    staged_values = {setpoint};
+  }
+  void stage_move(float target, float max_vel, float max_acc,
+                  float max_jerk) noexcept {
+    staged = staged_move;
+    staged_values = {target, max_vel, max_acc, max_jerk};
+  }
+  void latch() noexcept {
+    auto [a, b, c, d] = staged_values;
+    switch (staged) {
+    case nothing_staged:
+      return;
+    case staged_setpoint:
+      set_setpoint(a);
       break;
-    case current:
-      metric = dev_current;
+    case staged_move:
+      start_move(a, b, c, d);
       break;
-    default:;
     }
-    return pid().getOutput(metric);
+    staged = nothing_staged;
   }
 
-  Mode get_mode() const noexcept { return mode; }
+  // Captures current loop ticks, see capture.hpp.
+  void set_capture(Recorder::Trigger trigger, uint8_t decimation) noexcept {
+    recorder.configure(trigger, decimation);
+  }
+  std::span<uint8_t const> drain_capture() noexcept { return recorder.drain(); }
+
+  // Smooths velocity with an observer, see observer.hpp, and gives the
+  // position and velocity loops its velocity and acceleration for their D
+  // terms. Acceleration per current is in degrees per second squared per
+  // IPROPI volt.
+  void set_observer(uint8_t alpha, uint8_t beta, uint8_t gamma,
+                    float accel_per_current) noexcept {
+    bool was_enabled = observer.enabled();
+    float per_tick_squared = float(ticks_per_second) * ticks_per_second;
+    observer.set_gains(
+        {alpha, beta, gamma, q16_16(accel_per_current / per_tick_squared)});
+    if (!was_enabled)
+      observer.reset(q16_16::from_frac<4>(total_loc));
+  }
+  Observer::Gains const &get_observer() const noexcept {
+    return observer.get_gains();
+  }
 
+  // Starts counting turns over from this angle.
+  void update_loc(uint16_t value) noexcept {
+    current_loc = value;
+    total_loc = value;
+    turns = 0;
+  }
+  // A read that comes back with the set count of the last one is the same
+  // conversion again, and gets left out so the loops only see new angles.
+  void update_loc(uint16_t value, uint8_t set_count, uint32_t now) noexcept {
+    if (observer.enabled())
+      observer.predict(signed_current);
+    if (set_count == loc_set)
+      return;
+    // The first real conversion is where turns count from. Anything read
+    // before it is the sensor's reset value, not an angle.
+    if (loc_set == no_sample) {
+      loc_set = set_count;
+      update_loc(value);
+      vel_total = total_loc;
+      loc_time = vel_time = now;
+      ++loc_samples;
+      // one sample is no velocity yet, it would be 0 over 0 seconds
+      velocity_seen = loc_samples;
+      observer.reset(q16_16::from_frac<4>(total_loc));
+      return;
+    }
+    loc_set = set_count;
+    // whichever way round is shorter, so crossing 0 is a small step and
+    // not a whole turn
+    int16_t delta = int16_t(value - current_loc);
+    if (delta > full_turn / 2) {
+      delta -= full_turn;
+      --turns;
+    } else if (delta < -full_turn / 2) {
+      delta += full_turn;
+      ++turns;
+    }
+    total_loc += delta;
+    current_loc = value;
+    loc_time = now;
+    ++loc_samples;
+    if (observer.enabled())
+      observer.correct(q16_16::from_frac<4>(total_loc));
+  }
+  // raw IPROPI ADC counts
+  void set_current(uint16_t raw) noexcept {
+    dev_current_raw = raw;
+    dev_current = adc_volts_fixed(raw);
+  }
+
+  // Has to be called once before any of the loops run.
+  void start(uint32_t now) noexcept {
+    vel_total = total_loc;
+    loc_time = vel_time = now;
+    observer.reset(q16_16::from_frac<4>(total_loc));
+    last_current = last_velocity = last_position = now - tick_us;
+    publish();
+  }
+
+  // The loops take when the tick started in microseconds, see timebase::now(), and
+  // work off of the time that actually passed since they last ran. The rates
+  // they run at are set by the task table in main.cpp.
+  void run_position(uint32_t now) noexcept {
+    // nothing new to correct, the last output still stands
+    if (mode != position || loc_samples == position_seen)
+      return;
+    position_seen = loc_samples;
+    // angles are already 12.4 fixed point, so only current needs converting
+    q16_16 actual = q16_16::from_frac<4>(total_loc);
+    q16_16 dt = seconds(now - last_position);
+    position_output =
+        observer.enabled()
+            ? run(position, p_pid, actual, dt, per_second(observer.velocity()))
+            : run(position, p_pid, actual, dt);
+    last_position = now;
+  }
+
+  void run_velocity(uint32_t now) noexcept {
+    q16_16 dt = seconds(now - last_velocity);
+    last_velocity = now;
+    // over the time between the samples, not between runs
+    if (observer.enabled()) {
+      vel = per_second(observer.velocity());
+    } else if (loc_samples != velocity_seen) {
+      velocity_seen = loc_samples;
+      vel = q16_16::from_frac<4>(total_loc - vel_total) /
+            seconds(loc_time - vel_time);
+      vel_total = total_loc;
+      vel_time = loc_time;
+    }
+
+    if (mode == position) {
+      q16_16 vel_ff{};
+      if (profile.active()) {
+        profile.step();
+        p_pid.set_setpoint(q16_16(profile.position));
+        vel_ff = q16_16(profile.velocity);
+      }
+      v_pid.set_setpoint(position_output + vel_ff);
+    }
+    if (mode == current)
+      return;
+    // acceleration goes in as deg/s per tick, a second per_second would clip
+    // at 32767 deg/s^2, so D takes the last factor of ticks_per_second
+    i_pid.set_setpoint(
+        observer.enabled()
+            ? run(velocity, v_pid, vel, dt,
+                  per_second(observer.acceleration()), ticks_per_second)
+            : run(velocity, v_pid, vel, dt));
+  }
+
+  // the motor duty, 1.0 is full on
+  q16_16 run_current(uint32_t now) noexcept {
+    q16_16 dt = seconds(now - last_current);
+    last_current = now;
+    // IPROPI only gives the magnitude, so assume it flows the way we drive
+    signed_current = last_output < q16_16() ? -dev_current : dev_current;
+    last_output = run(current, i_pid, signed_current, dt);
+    if (recorder.recording())
+      recorder.record({uint16_t(now), current_loc,
+                       q12_4::from_frac<16>(vel.raw).raw,
+                       dev_current_raw,
+                       q15::from_frac<16>(last_output.raw).raw});
+    return last_output;
+  }
+
+  void publish() noexcept {
+    PID const &entry = pid();
+    // what p, i and d were set to, not what a schedule has them at
+    Schedule::Gains gains = scheduled(mode)
+                                ? configured[mode]
+                                : Schedule::Gains{entry.P, entry.I, entry.D};
+    published = {current_loc, total_loc,       turns,   vel,
+                 dev_current, dev_current_raw, entry.get_setpoint(),
+                 mode,        gains.P,         gains.I, gains.D,
+                 entry.F};
+  }
+  Snapshot const &snapshot() const noexcept { return published; }
+
+  // rough defaults so every mode moves, tune these over I2C
   DeviceState() {
-    p_pid.setOutputLimits(0.1);
-    p_pid.setP(0.001);
-    v_pid.setOutputLimits(0.1);
-    i_pid.setOutputLimits(0.1);
+    // degrees per second
+    p_pid.set_output_limits(q16_16(500.0f));
+    p_pid.set_P(25);
+    // IPROPI volts
+    v_pid.set_output_limits(q16_16(1.0f));
+    v_pid.set_P(0.001);
+    // PWM duty
+    i_pid.set_output_limits(q16_16(0.1f));
+    i_pid.set_P(0.1);
   };
 
   DeviceState(DeviceState &&) = delete;
@@ -60,17 +347,89 @@ struct DeviceState {
   ~DeviceState() = default;
 
   void transition_state(Mode new_state, float setpoint) noexcept {
-    if (new_state == mode)
-      return;
-    mode = new_state;
-    pid().reset();
-    pid().setSetpoint(setpoint);
+    profile.stop();
+    if (new_state != mode) {
+      mode = new_state;
+      // the new entry loop and everything inside of it starts from scratch
+      switch (mode) {
+      case position:
+        p_pid.reset();
+        [[fallthrough]];
+      case velocity:
+        v_pid.reset();
+        [[fallthrough]];
+      case current:
+        i_pid.reset();
+      }
+    }
+    pid().set_setpoint(q16_16(setpoint));
+    recorder.setpoint_changed();
+  }
+  void set_setpoint(float setpoint) noexcept {
+    apply_setpoint(q16_16(setpoint));
+  }
+  void set_setpoint_fixed(int16_t setpoint) noexcept {
+    apply_setpoint(mode == current ? q16_16::from_frac<12>(setpoint)
+                                   : q16_16::from_frac<4>(setpoint));
   }
-  void set_setpoint(float setpoint) noexcept { pid().setSetpoint(setpoint); }
 
 private:
-  MiniPID &pid() noexcept {
-    switch (mode) {
+  void apply_setpoint(q16_16 setpoint) noexcept {
+    profile.stop();
+    pid().set_setpoint(setpoint);
+    recorder.setpoint_changed();
+  }
+
+  // the only features any mode enables; the limits also cap the I term
+  using PID = PidController<q16_16, pid::output_limits, pid::integral_limit>;
+
+  // capped at half a second so a stall doesn't wind anything up
+  static q16_16 seconds(uint32_t us) noexcept {
+    if (us > 500000)
+      us = 500000;
+    // 4295 / 2^16 is about 2^16 / 10^6
+    return q16_16::from_raw(int32_t(us * 4295 >> 16));
+  }
+
+  // the observer's rates are per tick
+  static q16_16 per_second(q16_16 per_tick) noexcept {
+    return q16_16::from_raw(q16_16::wide(per_tick.raw) * ticks_per_second);
+  }
+
+  q16_16 run(Mode loop, PID &pid, q16_16 actual, q16_16 dt) noexcept {
+    schedule(loop, pid, actual);
+    return pid.get_output(actual, dt);
+  }
+  // with how fast actual is changing, for the D term
+  q16_16 run(Mode loop, PID &pid, q16_16 actual, q16_16 dt, q16_16 rate,
+             int32_t rate_scale = 1) noexcept {
+    schedule(loop, pid, actual);
+    return pid.get_output(actual, dt, rate, rate_scale);
+  }
+  // loads the gains for where the loop is, if it has a schedule
+  void schedule(Mode loop, PID &pid, q16_16 actual) noexcept {
+    Schedule const &schedule = schedules[loop];
+    q16_16 x;
+    switch (schedule.source) {
+    case Schedule::off:
+      return;
+    case Schedule::error:
+      x = abs(pid.get_setpoint() - actual);
+      break;
+    case Schedule::velocity:
+      x = abs(vel);
+      break;
+    case Schedule::setpoint:
+      x = pid.get_setpoint();
+      break;
+    }
+    auto gains = schedule.lookup(x);
+    pid.set_gains(gains.P, gains.I, gains.D);
+  }
+
+  PID &pid() noexcept { return pid(mode); }
+  PID &pid(Mode loop) noexcept {
+    switch (loop) {
     case position:
       return p_pid;
     case velocity:
@@ -80,7 +439,10 @@ private:
     }
     __builtin_unreachable();
   }
-  const MiniPID &pid() const noexcept {
+  bool scheduled(Mode loop) const noexcept {
+    return schedules[loop].source != Schedule::off;
+  }
+  const PID &pid() const noexcept {
     switch (mode) {
     case position:
       return p_pid;
@@ -92,8 +454,32 @@ private:
     __builtin_unreachable();
   }
   Mode mode = DeviceState::position;
-  MiniPID p_pid = {0, 0, 0, 0}, v_pid = {0, 0, 0, 0}, i_pid = {0, 0, 0, 0};
-  uint16_t prev_loc = 0;
+  PID p_pid, v_pid, i_pid;
+  std::array<Schedule, 3> schedules{};
+  // each loop's own gains, while its schedule overrides them
+  std::array<Schedule::Gains, 3> configured{};
+  MotionProfile profile{velocity_period};
+  q16_16 position_output{};
   uint16_t current_loc = 0;
-  float dev_current = 0;
+  // the angle in 12.4 degrees without wrapping, and the turns it's made
+  int32_t total_loc = 0, turns = 0;
+  int32_t vel_total = 0;
+  q16_16 vel{};
+  // when the TMAG's conversions come in, counted so the loops can tell
+  // whether they've seen the latest one
+  static constexpr uint8_t no_sample = 0xff;
+  uint8_t loc_set = no_sample;
+  uint8_t loc_samples = 0, position_seen = 0, velocity_seen = 0;
+  uint32_t loc_time = 0, vel_time = 0;
+  uint32_t last_current = 0, last_velocity = 0, last_position = 0;
+  q16_16 dev_current{};
+  uint16_t dev_current_raw = 0;
+  q16_16 signed_current{};
+  Observer observer;
+  q16_16 last_output{};
+  Snapshot published{};
+  Recorder recorder;
+  enum Staged : uint8_t { nothing_staged, staged_setpoint, staged_move };
+  Staged staged = nothing_staged;
+  std::array<float, 4> staged_values{};
 };
\ No newline at end of file
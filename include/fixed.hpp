@@ -0,0 +1,114 @@
+#pragma once
+
+#include <compare>
+#include <cstdint>
+#include <limits>
+
+namespace fixed_impl {
+template <typename T> struct wider;
+template <> struct wider<int16_t> {
+  using type = int32_t;
+};
+template <> struct wider<int32_t> {
+  using type = int64_t;
+};
+} // namespace fixed_impl
+
+// Signed fixed point number with Frac fractional bits. Everything saturates
+// instead of wrapping, since a clamped motor output is a lot less exciting
+// than one that suddenly flips sign.
+template <typename Rep, uint8_t Frac> struct Fixed {
+  using rep = Rep;
+  using wide = typename fixed_impl::wider<Rep>::type;
+  static constexpr uint8_t frac_bits = Frac;
+  static constexpr wide one = wide(1) << Frac;
+
+  Rep raw = 0;
+
+  constexpr Fixed() = default;
+  // float conversions are only meant for configuration, not per tick
+  constexpr explicit Fixed(float f) noexcept {
+    float scaled = f * float(one);
+    if (scaled >= float(std::numeric_limits<Rep>::max()))
+      raw = std::numeric_limits<Rep>::max();
+    else if (scaled <= float(std::numeric_limits<Rep>::min()))
+      raw = std::numeric_limits<Rep>::min();
+    else
+      raw = Rep(scaled);
+  }
+
+  static constexpr Fixed from_raw(wide value) noexcept {
+    Fixed f;
+    if (value > std::numeric_limits<Rep>::max())
+      f.raw = std::numeric_limits<Rep>::max();
+    else if (value < std::numeric_limits<Rep>::min())
+      f.raw = std::numeric_limits<Rep>::min();
+    else
+      f.raw = Rep(value);
+    return f;
+  }
+
+  // converts a value with SrcFrac fractional bits, like the 12.4 TMAG angle
+  template <uint8_t SrcFrac>
+  static constexpr Fixed from_frac(wide value) noexcept {
+    if constexpr (SrcFrac < Frac)
+      return from_raw(value * (wide(1) << (Frac - SrcFrac)));
+    else
+      return from_raw(value >> (SrcFrac - Frac));
+  }
+
+  static constexpr Fixed max() noexcept {
+    return from_raw(std::numeric_limits<Rep>::max());
+  }
+  static constexpr Fixed min() noexcept {
+    return from_raw(std::numeric_limits<Rep>::min());
+  }
+
+  constexpr float to_float() const noexcept { return raw / float(one); }
+
+  friend constexpr Fixed operator+(Fixed a, Fixed b) noexcept {
+    Fixed r;
+    if (__builtin_add_overflow(a.raw, b.raw, &r.raw))
+      return b.raw < 0 ? min() : max();
+    return r;
+  }
+  friend constexpr Fixed operator-(Fixed a, Fixed b) noexcept {
+    Fixed r;
+    if (__builtin_sub_overflow(a.raw, b.raw, &r.raw))
+      return b.raw < 0 ? max() : min();
+    return r;
+  }
+  constexpr Fixed operator-() const noexcept {
+    if (raw == std::numeric_limits<Rep>::min())
+      return max();
+    Fixed r;
+    r.raw = -raw;
+    return r;
+  }
+  friend constexpr Fixed operator*(Fixed a, Fixed b) noexcept {
+    return from_raw((wide(a.raw) * b.raw) >> Frac);
+  }
+  friend constexpr Fixed operator/(Fixed a, Fixed b) noexcept {
+    if (b.raw == 0)
+      return a.raw < 0 ? min() : max();
+    return from_raw(wide(a.raw) * one / b.raw);
+  }
+
+  constexpr Fixed &operator+=(Fixed o) noexcept { return *this = *this + o; }
+  constexpr Fixed &operator-=(Fixed o) noexcept { return *this = *this - o; }
+  constexpr Fixed &operator*=(Fixed o) noexcept { return *this = *this * o; }
+  constexpr Fixed &operator/=(Fixed o) noexcept { return *this = *this / o; }
+
+  friend constexpr auto operator<=>(Fixed, Fixed) = default;
+  friend constexpr bool operator==(Fixed, Fixed) = default;
+
+  friend constexpr Fixed abs(Fixed a) noexcept { return a.raw < 0 ? -a : a; }
+};
+
+// Q15 only covers [-1, 1), so inputs have to be normalized before using it
+using q15 = Fixed<int16_t, 15>;
+// same as the TMAG angle, for the compact registers
+using q12_4 = Fixed<int16_t, 4>;
+// IPROPI volts for the compact registers, which only go up to 5
+using q4_12 = Fixed<int16_t, 12>;
+using q16_16 = Fixed<int32_t, 16>;
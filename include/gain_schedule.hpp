@@ -0,0 +1,66 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "fixed.hpp"
+
+// Piecewise linear P/I/D gains over a scheduling variable. Slopes are worked
+// out when the table is committed, so a lookup is a walk over all N points
+// plus three multiplies no matter where x lands.
+template <typename Q, uint8_t N> struct GainSchedule {
+  enum Source : uint8_t { off, error, velocity, setpoint };
+
+  struct Gains {
+    Q P, I, D;
+  };
+  struct Point {
+    Q x;
+    Gains gains;
+    // per unit of x towards the next point, zero for the last one
+    Gains slope;
+  };
+
+  void set_point(uint8_t index, Q x, Gains gains) noexcept {
+    if (index >= N)
+      return;
+    points[index].x = x;
+    points[index].gains = gains;
+  }
+
+  // Points have to be sorted by x. Anything else turns the schedule off.
+  void commit(Source new_source, uint8_t new_size) noexcept {
+    source = off;
+    if (new_size == 0 || new_size > N)
+      return;
+    for (uint8_t i = 0; i + 1 < new_size; i++) {
+      Point &a = points[i];
+      Point const &b = points[i + 1];
+      Q dx = b.x - a.x;
+      if (dx <= Q())
+        return;
+      a.slope = {(b.gains.P - a.gains.P) / dx, (b.gains.I - a.gains.I) / dx,
+                 (b.gains.D - a.gains.D) / dx};
+    }
+    points[new_size - 1].slope = {};
+    size = new_size;
+    source = new_source;
+  }
+
+  Gains lookup(Q x) const noexcept {
+    uint8_t seg = 0;
+    for (uint8_t i = 1; i != N; i++) {
+      if (i < size && points[i].x <= x)
+        seg = i;
+    }
+    Point const &p = points[seg];
+    // below the first point the gains are held, same for above the last
+    Q dx = x < p.x ? Q() : x - p.x;
+    return {p.gains.P + p.slope.P * dx, p.gains.I + p.slope.I * dx,
+            p.gains.D + p.slope.D * dx};
+  }
+
+  Source source = off;
+  uint8_t size = 0;
+  std::array<Point, N> points{};
+};
@@ -4,10 +4,12 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <cstdint>
+#include <span>
+#include <type_traits>
 #include <vector>
 
-#include "nonstd/ring_span.hpp"
 #include "set_reg.hpp"
+#include "spsc_ring.hpp"
 
 enum struct I2cStatus : uint8_t {
   start_sr = 0x60,
@@ -23,13 +25,14 @@ enum struct I2cStatus : uint8_t {
   stop_st_err = 0xc8
 };
 
+// as big as the longest write
+using buffer_span = SpscRing<64>;
+
 inline uint8_t g = 0;
 template <typename WriteCallback, typename ReadCallback> struct I2c {
 
   I2c(WriteCallback on_write, ReadCallback on_read)
-      : in_buf(in_buf_raw.begin(), in_buf_raw.end()),
-        out_buf(out_buf_raw.begin(), out_buf_raw.end()), write(on_write),
-        read(on_read) {}
+      : write(on_write), read(on_read) {}
 
 public:
   bool _serve(I2cStatus status) noexcept {
@@ -41,6 +44,8 @@ public:
         return false;
       }
       mode = addressing;
+      general = status == start_gen;
+      out_buf.clear();
       return true;
     case ack_sr:
     case ack_gen: {
@@ -50,48 +55,76 @@ public:
         mode = writing;
         return true;
       }
+      // a write too long for the buffer gets its next byte nacked
       out_buf.push_back(data);
-      return true;
+      return !out_buf.full();
     }
 
     case stop_sr: {
+      // a broadcast can be just a command, but not nothing
+      bool addressed = mode == writing;
       mode = idle;
-      if (!out_buf.empty())
+      if constexpr (takes_general) {
+        if ((general && addressed) || !out_buf.empty())
+          write(address, out_buf, general);
+      } else if (!general && !out_buf.empty()) {
         write(address, out_buf);
-      while (!out_buf.empty()) {
-        out_buf.pop_front();
       }
+      out_buf.clear();
       return true;
     }
 
-    case start_st: {
+    case start_st:
       g++;
-      read(address, in_buf);
-      TWDR = in_buf.pop_front();
-      return !in_buf.empty();
-    }
+      if constexpr (serves_span) {
+        response = read(address);
+        responding = true;
+      } else {
+        // whatever the last read didn't get to is stale now
+        in_buf.clear();
+        read(address, in_buf);
+      }
+      [[fallthrough]];
     case ack_st: {
-      if (in_buf.empty()) {
-        mode = idle;
-        TWDR = 0xff;
-        return false;
+      if constexpr (serves_span) {
+        // past the end the master gets 0xff until it nacks
+        if (response.empty()) {
+          TWDR = 0xff;
+        } else {
+          TWDR = response.front();
+          response = response.subspan(1);
+        }
+        return true;
+      } else {
+        if (in_buf.empty()) {
+          mode = idle;
+          TWDR = 0xff;
+          return false;
+        }
+        TWDR = in_buf.pop_front();
+        return !in_buf.empty();
       }
-      TWDR = in_buf.pop_front();
-      return !in_buf.empty();
     }
     case nack_st: {
       mode = idle;
+      responding = false;
       return true;
     }
 
     case nack_sr: {
-      return mode == addressing;
+      // Too long, the master knows it didn't go through. Acking here keeps
+      // the slave listening for its address, a nack would turn that off
+      // until reset.
+      out_buf.clear();
+      mode = idle;
+      return true;
     }
 
     case stop_st_err:
     case nack_gen:
     default:
       mode = idle;
+      responding = false;
       return true;
     }
   }
@@ -99,10 +132,24 @@ public:
   // private:
   enum Mode : uint8_t { idle, addressing, writing };
 
+  // A read callback that only takes the address returns bytes that are
+  // already laid out, and the interrupt sends straight out of them. Those
+  // bytes have to stay put while responding is set.
+  static constexpr bool serves_span =
+      std::is_invocable_r_v<std::span<uint8_t const>, ReadCallback &, uint8_t>;
+  // A write callback that also takes a bool gets general calls too, with it
+  // set. Their first byte is still the address, it just means a broadcast
+  // command. Anything else only gets writes to this node.
+  static constexpr bool takes_general =
+      std::is_invocable_v<WriteCallback &, uint8_t, buffer_span &, bool>;
+
+  std::span<uint8_t const> response{};
+  volatile bool responding = false;
+
   Mode mode = idle;
-  std::array<uint8_t, 64> in_buf_raw{}, out_buf_raw{};
-  nonstd::ring_span_lite::ring_span<uint8_t> in_buf;
-  nonstd::ring_span_lite::ring_span<uint8_t> out_buf;
+  bool general = false;
+  buffer_span in_buf;
+  buffer_span out_buf;
   uint8_t address{};
   WriteCallback write;
   ReadCallback read;
@@ -115,9 +162,13 @@ inline void i2c_nack() noexcept {
 
 inline void i2c_ack() noexcept { TWCR |= setmask(TWEA, TWINT); }
 
-inline void init_i2c(uint8_t address = 0xfe) noexcept {
+inline void init_i2c(uint8_t address = 0xfe,
+                     bool general_calls = true) noexcept {
   TWCR = setmask(TWEN, TWIE, TWEA);
   // todo actually maybe the thermistor voltage divider can be used to config
   // this
-  TWAR = address & 0xfe;
+  TWAR = (address & 0xfe) | (general_calls ? setmask(TWGCE) : 0);
 }
+
+// the 7 bit address, which is also what broadcasts call this node
+inline uint8_t i2c_address() noexcept { return TWAR >> 1; }
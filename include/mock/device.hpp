@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include "debug.hpp"
 
 struct MockDevice {
@@ -9,6 +11,11 @@ struct MockDevice {
   float get_vel() const noexcept { return 1; }
   float get_current() const noexcept { return 0.2; }
   float get_setpoint() const noexcept { return 0; }
+  int32_t get_turns() const noexcept { return 0; }
+  uint16_t get_angle_fixed() const noexcept { return 23 << 4; }
+  int16_t get_vel_fixed() const noexcept { return 1 << 4; }
+  uint16_t get_current_raw() const noexcept { return 41; }
+  int16_t get_setpoint_fixed() const noexcept { return 0; }
   float get_P() const noexcept { return 0; }
   float get_I() const noexcept { return 0; }
   float get_D() const noexcept { return 0; }
@@ -18,10 +25,29 @@ struct MockDevice {
   void set_D(float d) noexcept { debug_print("setting D to %f", d); }
   void set_F(float f) noexcept { debug_print("setting F to %f", f); }
 
+  void set_schedule_point(Mode loop, uint8_t index, float x, float p, float i,
+                          float d) noexcept {
+    debug_print("schedule %d point %d at %f: %f %f %f", loop, index, x, p, i,
+                d);
+  }
+  void set_schedule(Mode loop, uint8_t source, uint8_t size) noexcept {
+    debug_print("schedule %d on source %d with %d points", loop, source, size);
+  }
+
+  void start_move(float target, float max_vel, float max_acc,
+                  float max_jerk) noexcept {
+    debug_print("moving to %f at %f, %f, %f", target, max_vel, max_acc,
+                max_jerk);
+  }
+
   void update_loc(uint16_t loc) noexcept { debug_print("location at %d", loc); }
   void set_current(float f) noexcept { debug_print("set current to %f", f); }
 
-  float get_output() noexcept { return 0.5; }
+  void start(uint32_t) noexcept {}
+  void run_position(uint32_t) noexcept {}
+  void run_velocity(uint32_t) noexcept {}
+  float run_current(uint32_t) noexcept { return 0.5; }
+  void publish() noexcept {}
   Mode get_mode() const noexcept { return position; }
 
   MockDevice() = default;
@@ -35,4 +61,7 @@ struct MockDevice {
   void set_setpoint(float setpoint) noexcept {
     debug_print("setpoint set to %f", setpoint);
   }
+  void set_setpoint_fixed(int16_t setpoint) noexcept {
+    debug_print("setpoint set to %d/16", setpoint);
+  }
 };
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+#include "fixed.hpp"
+
+// Alpha-beta-gamma tracker for the angle, so velocity and acceleration come
+// out smooth instead of in 1/16 degree steps. Everything is kept per control
+// tick, which keeps dt out of the math, and the gains are powers of two, so
+// a correction is three shifts and a tick costs no multiplies unless current
+// is fed in. Current goes in as the acceleration it should cause, which
+// leaves gamma to track whatever the load adds on top.
+class Observer {
+public:
+  struct Gains {
+    // each one is 2^-shift, alpha of 0 turns the observer off
+    uint8_t alpha = 0, beta = 0, gamma = 0;
+    // degrees per tick squared per IPROPI volt
+    q16_16 accel_per_current{};
+  };
+
+  // Shifts past 30 would shift out the whole residual anyway.
+  void set_gains(Gains new_gains) noexcept {
+    auto cap = [](uint8_t &shift) {
+      if (shift > 30)
+        shift = 30;
+    };
+    cap(new_gains.alpha);
+    cap(new_gains.beta);
+    cap(new_gains.gamma);
+    gains = new_gains;
+  }
+  Gains const &get_gains() const noexcept { return gains; }
+  bool enabled() const noexcept { return gains.alpha != 0; }
+
+  // Starts over, sitting still at position.
+  void reset(q16_16 position) noexcept {
+    x = position.raw;
+    v = a = 0;
+  }
+
+  // Once a tick, whether or not there's a new angle.
+  void predict(q16_16 current) noexcept {
+    int32_t accel = a;
+    if (gains.accel_per_current != q16_16())
+      accel += (gains.accel_per_current * current).raw;
+    x += v + (accel >> 1);
+    v += accel;
+  }
+
+  // Pulls the estimate towards a new angle.
+  void correct(q16_16 measured) noexcept {
+    int32_t residual = measured.raw - x;
+    x += residual >> gains.alpha;
+    v += residual >> gains.beta;
+    a += residual >> gains.gamma;
+  }
+
+  q16_16 position() const noexcept { return q16_16::from_raw(x); }
+  // degrees per tick
+  q16_16 velocity() const noexcept { return q16_16::from_raw(v); }
+  // degrees per tick squared
+  q16_16 acceleration() const noexcept { return q16_16::from_raw(a); }
+
+private:
+  Gains gains{};
+  // q16_16 raw, the corrections are plain shifts and adds
+  int32_t x = 0, v = 0, a = 0;
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <type_traits>
+
+#include "fixed.hpp"
+
+// Optional PID features. Each one brings its own storage, and a controller
+// that isn't given a feature has neither the fields nor the branches for it.
+namespace pid {
+// caps the output of the I term, see MiniPID::setMaxIOutput
+struct integral_limit {
+  template <typename Q> struct storage {
+    Q max_i_output = Q::max(), max_error = Q::max();
+  };
+};
+struct output_limits {
+  template <typename Q> struct storage {
+    Q min_output = Q::min(), max_output = Q::max();
+  };
+};
+// max change of the output per second
+struct ramp_rate {
+  template <typename Q> struct storage {
+    Q output_ramp_rate = Q::max();
+  };
+};
+// valid between [0, 1), see MiniPID::setOutputFilter
+struct output_filter {
+  template <typename Q> struct storage {
+    Q output_filter{};
+  };
+};
+// max distance between the setpoint and the actual value
+struct setpoint_range {
+  template <typename Q> struct storage {
+    Q setpoint_range = Q::max();
+  };
+};
+} // namespace pid
+
+namespace pid_impl {
+template <typename Q> struct last_output_storage {
+  Q last_output{};
+};
+struct empty {};
+} // namespace pid_impl
+
+// Fixed point port of MiniPID (see pid.cpp). The windup handling is the same,
+// but every per tick operation is integer math, which matters a lot on a part
+// without an FPU. Gains are still set with floats since those only change
+// over I2C.
+//
+// Every update takes the time since the last one in seconds, so the I gain is
+// per second, the D gain is in seconds and the loop rate can change without
+// retuning.
+template <typename Q, typename... Features>
+class PidController
+    : public Features::template storage<Q>...,
+      public std::conditional_t<
+          (std::is_same_v<Features, pid::ramp_rate> || ...) ||
+              (std::is_same_v<Features, pid::output_filter> || ...),
+          pid_impl::last_output_storage<Q>, pid_impl::empty> {
+public:
+  template <typename Feature>
+  static constexpr bool has = (std::is_same_v<Feature, Features> || ...);
+
+  constexpr PidController() = default;
+  PidController(float p, float i, float d, float f = 0) noexcept
+      : P(p), I(i), D(d), F(f) {}
+
+  void set_P(float p) noexcept {
+    P = Q(p);
+    check_signs();
+  }
+  void set_I(float i) noexcept {
+    Q new_i = Q(i);
+    // keeps the I term output constant across the change, like MiniPID
+    if (I != Q() && new_i != Q())
+      error_sum = widen(to_q(error_sum) * (I / new_i));
+    if constexpr (has<pid::integral_limit>)
+      this->max_error = this->max_i_output / new_i;
+    I = new_i;
+    check_signs();
+  }
+  void set_D(float d) noexcept {
+    D = Q(d);
+    check_signs();
+  }
+  void set_F(float f) noexcept {
+    F = Q(f);
+    check_signs();
+  }
+
+  void set_max_i_output(Q maximum) noexcept
+    requires has<pid::integral_limit>
+  {
+    this->max_i_output = maximum;
+    this->max_error = maximum / I;
+  }
+  void set_output_limits(Q output) noexcept
+    requires has<pid::output_limits>
+  {
+    set_output_limits(-output, output);
+  }
+  void set_output_limits(Q minimum, Q maximum) noexcept
+    requires has<pid::output_limits>
+  {
+    if (maximum < minimum)
+      return;
+    this->max_output = maximum;
+    this->min_output = minimum;
+    if constexpr (has<pid::integral_limit>)
+      if (this->max_i_output > (maximum - minimum))
+        set_max_i_output(maximum - minimum);
+  }
+  void set_output_ramp_rate(Q rate) noexcept
+    requires has<pid::ramp_rate>
+  {
+    this->output_ramp_rate = rate;
+  }
+  void set_output_filter(Q strength) noexcept
+    requires has<pid::output_filter>
+  {
+    if (strength >= Q())
+      this->output_filter = strength;
+  }
+  void set_setpoint_range(Q range) noexcept
+    requires has<pid::setpoint_range>
+  {
+    this->setpoint_range = range;
+  }
+  // For gain scheduling. Unlike set_I this doesn't rescale the I sum, since
+  // that would be a division every tick.
+  void set_gains(Q p, Q i, Q d) noexcept {
+    P = p;
+    I = i;
+    D = d;
+  }
+  void set_direction(bool is_reversed) noexcept { reversed = is_reversed; }
+  void set_setpoint(Q sp) noexcept { setpoint = sp; }
+
+  void reset() noexcept {
+    first_run = true;
+    error_sum = 0;
+  }
+
+  Q get_setpoint() const noexcept { return setpoint; }
+
+  Q get_output(Q actual, Q dt) noexcept {
+    // the division is only worth paying for if there's a D term at all
+    Q rate{};
+    if (!first_run && D != Q() && dt != Q())
+      rate = (actual - last_actual) / dt;
+    return get_output(actual, dt, rate);
+  }
+
+  // For when there's a better idea of how fast actual is changing than the
+  // difference to the last update, like an observer's. Rate times rate_scale
+  // is per second, so a per tick rate can go in with the ticks per second as
+  // the scale, and isn't clipped to what Q holds per second.
+  Q get_output(Q actual, Q dt, Q rate, int32_t rate_scale = 1) noexcept {
+    Q sp = setpoint;
+    if constexpr (has<pid::setpoint_range>)
+      sp = clamp(sp, actual - this->setpoint_range,
+                 actual + this->setpoint_range);
+
+    Q error = sp - actual;
+    Q f_output = F * sp;
+    Q p_output = P * error;
+
+    if (first_run) {
+      last_actual = actual;
+      if constexpr (has_last_output)
+        this->last_output = p_output + f_output;
+      first_run = false;
+    }
+
+    Q d_output{};
+    if (D != Q()) {
+      // D * rate * rate_scale all in sum, the scale going on after D has
+      // brought a per tick rate back down
+      sum product;
+      if (__builtin_mul_overflow(sum(D.raw) * rate.raw, rate_scale, &product))
+        product = (D.raw ^ rate.raw ^ rate_scale) < 0 ? -widen(Q::max())
+                                                      : widen(Q::max());
+      d_output = -to_q(product);
+    }
+    last_actual = actual;
+
+    Q i_output = I * to_q(error_sum);
+    if constexpr (has<pid::integral_limit>)
+      i_output = clamp(i_output, -this->max_i_output, this->max_i_output);
+
+    Q output = f_output + p_output + i_output + d_output;
+
+    // same windup rules as MiniPID::getOutput
+    sum error_dt = sum(error.raw) * dt.raw;
+    bool saturated = false;
+    if constexpr (has<pid::output_limits>)
+      saturated = !bounded(output, this->min_output, this->max_output);
+    Q ramp{};
+    if constexpr (has<pid::ramp_rate>) {
+      ramp = this->output_ramp_rate * dt;
+      saturated = saturated || !bounded(output, this->last_output - ramp,
+                                        this->last_output + ramp);
+    }
+    if (saturated)
+      error_sum = error_dt;
+    else if constexpr (has<pid::integral_limit>)
+      error_sum = clamp_sum(error_sum + error_dt, widen(this->max_error));
+    else
+      error_sum = clamp_sum(error_sum + error_dt, widen(Q::max()));
+
+    if constexpr (has<pid::ramp_rate>)
+      output = clamp(output, this->last_output - ramp, this->last_output + ramp);
+    if constexpr (has<pid::output_limits>)
+      output = clamp(output, this->min_output, this->max_output);
+    // last * f + out * (1 - f), rearranged so Q15 never needs to hold 1
+    if constexpr (has<pid::output_filter>)
+      output = output + (this->last_output - output) * this->output_filter;
+
+    if constexpr (has_last_output)
+      this->last_output = output;
+    return output;
+  }
+
+  Q P{}, I{}, D{}, F{};
+
+private:
+  static constexpr bool has_last_output =
+      has<pid::ramp_rate> || has<pid::output_filter>;
+
+  static constexpr Q clamp(Q value, Q min, Q max) noexcept {
+    if (value > max)
+      return max;
+    if (value < min)
+      return min;
+    return value;
+  }
+  // error * dt keeps the fractional bits of both, a tick with a small error
+  // is well under one bit of Q and would round away to nothing otherwise
+  using sum = int64_t;
+  static constexpr sum widen(Q value) noexcept {
+    return sum(value.raw) << Q::frac_bits;
+  }
+  static constexpr Q to_q(sum value) noexcept {
+    value = (value + (sum(1) << (Q::frac_bits - 1))) >> Q::frac_bits;
+    return Q::from_raw(clamp_sum(value, Q::max().raw));
+  }
+  static constexpr sum clamp_sum(sum value, sum limit) noexcept {
+    if (value > limit)
+      return limit;
+    if (value < -limit)
+      return -limit;
+    return value;
+  }
+  static constexpr bool bounded(Q value, Q min, Q max) noexcept {
+    return (min < value) && (value < max);
+  }
+  void check_signs() noexcept {
+    auto fix = [this](Q &gain) {
+      if (reversed ? gain > Q() : gain < Q())
+        gain = -gain;
+    };
+    fix(P);
+    fix(I);
+    fix(D);
+    fix(F);
+  }
+
+  sum error_sum = 0;
+  Q setpoint{}, last_actual{};
+  bool first_run = true;
+  bool reversed = false;
+};
+
+// everything MiniPID can do
+template <typename Q>
+using FixedPID =
+    PidController<Q, pid::integral_limit, pid::output_limits, pid::ramp_rate,
+                  pid::output_filter, pid::setpoint_range>;
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <type_traits>
+
+#include "timer.hpp"
+
+// Cycle counts of each stage of the main loop and the TWI interrupt. Probes
+// only exist in debug builds; with NDEBUG, probed() is just the call.
+enum struct Stage : uint8_t {
+  spi,
+  adc,
+  observer,
+  position,
+  velocity,
+  current,
+  motor,
+  twi,
+  count
+};
+
+#ifndef NDEBUG
+struct CycleStats {
+  // in timer2 ticks, converted to cycles when read
+  uint16_t min = 0xffff, max = 0;
+  // exponential average over about 16 samples, as 12.4 fixed point
+  uint32_t mean_x16 = 0;
+
+  void add(uint16_t ticks) noexcept {
+    if (ticks < min)
+      min = ticks;
+    if (ticks > max)
+      max = ticks;
+    if (mean_x16 == 0)
+      mean_x16 = uint32_t(ticks) << 4;
+    else
+      mean_x16 += ticks - (mean_x16 >> 4);
+  }
+};
+
+inline std::array<CycleStats, size_t(Stage::count)> probe_stats{};
+
+constexpr uint8_t probe_stats_size = size_t(Stage::count) * 3 * sizeof(uint16_t);
+
+// avr-libc's end of static data, where the heap would start
+extern "C" uint8_t __heap_start;
+
+namespace probe_impl {
+constexpr uint8_t stack_paint = 0xc5;
+}
+
+// Fills the free RAM below the stack, so stack_headroom can tell how deep it
+// ever got. Once at boot with interrupts off.
+inline void paint_stack() noexcept {
+  uint8_t *top = reinterpret_cast<uint8_t *>(SP);
+  for (uint8_t *at = &__heap_start; at < top; at++) {
+    *at = probe_impl::stack_paint;
+  }
+}
+
+// Bytes between static data and the deepest the stack has been since
+// paint_stack.
+inline uint16_t stack_headroom() noexcept {
+  uint8_t const *at = &__heap_start;
+  while (*at == probe_impl::stack_paint)
+    at++;
+  return at - &__heap_start;
+}
+
+// {min, max, mean} cycles per stage, saturated to 16 bits
+inline void push_probe_stats(auto &buffer) noexcept {
+  auto push = [&](uint32_t ticks) {
+    uint32_t cycles = ticks * timebase::cycles_per_tick;
+    uint16_t value = cycles > 0xffff ? 0xffff : cycles;
+    buffer.push_back(value & 0xff);
+    buffer.push_back(value >> 8);
+  };
+  for (CycleStats const &stats : probe_stats) {
+    push(stats.max == 0 ? 0 : stats.min);
+    push(stats.max);
+    push(stats.mean_x16 >> 4);
+  }
+}
+#endif
+
+template <typename F> inline auto probed(Stage stage, F &&f) noexcept {
+#ifndef NDEBUG
+  uint16_t start = timebase::ticks();
+  if constexpr (std::is_void_v<decltype(f())>) {
+    f();
+    probe_stats[uint8_t(stage)].add(uint16_t(timebase::ticks()) - start);
+  } else {
+    auto result = f();
+    probe_stats[uint8_t(stage)].add(uint16_t(timebase::ticks()) - start);
+    return result;
+  }
+#else
+  return f();
+#endif
+}
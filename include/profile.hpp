@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Online trapezoidal profile. Each step picks the fastest velocity that can
+// still brake onto the target, so a new target can be given mid move. With a
+// jerk limit the trapezoid's velocity is put through a moving average as long
+// as one acceleration ramp, which turns it into an S-curve that still ends on
+// the target. This only runs at an outer loop rate, so it sticks to float.
+struct MotionProfile {
+  // 256 ms at the velocity loop rate
+  static constexpr uint8_t max_window = 16;
+
+  explicit MotionProfile(float step_seconds) noexcept : dt(step_seconds) {}
+
+  // Units are degrees and seconds, a jerk of 0 means unlimited. An
+  // acceleration that would take longer than max_window steps to ramp up to
+  // at max_jerk gets lowered to what it does reach, so the jerk limit holds.
+  void start(float from, float from_vel, float to, float max_vel,
+             float max_acc, float max_jerk = 0) noexcept {
+    if (max_vel <= 0 || max_acc <= 0 || max_jerk < 0)
+      return;
+    position = ramp_position = from;
+    velocity = ramp_velocity = from_vel;
+    acceleration = 0;
+    target = to;
+    vel_limit = max_vel;
+    acc_limit = max_acc;
+    window_size = 1;
+    if (max_jerk != 0) {
+      float steps = std::ceil(max_acc / max_jerk / dt);
+      if (steps > max_window) {
+        steps = max_window;
+        acc_limit = max_jerk * max_window * dt;
+      }
+      window_size = std::fmax(steps, 1);
+    }
+    // the last move's window could have been longer
+    window.fill(from_vel);
+    window_sum = from_vel * window_size;
+    head = 0;
+    moving = true;
+  }
+  void stop() noexcept {
+    moving = false;
+    velocity = 0;
+    acceleration = 0;
+  }
+  bool active() const noexcept { return moving; }
+
+  void step() noexcept {
+    if (!moving)
+      return;
+    float remaining = target - ramp_position;
+    // fastest speed that still brakes onto the target in whole steps
+    float step_acc = acc_limit * dt;
+    float stop_vel = step_acc * (std::sqrt(0.25f + 2 * std::fabs(remaining) /
+                                                       (step_acc * dt)) -
+                                 0.5f);
+    float wanted = std::copysign(std::fmin(vel_limit, stop_vel), remaining);
+    ramp_velocity += clamp(wanted - ramp_velocity, -step_acc, step_acc);
+    ramp_position += ramp_velocity * dt;
+
+    float left = target - ramp_position;
+    if ((left < 0) != (remaining < 0) || left == 0 ||
+        (std::fabs(left) < 1.0f / 16 && std::fabs(ramp_velocity) <= step_acc)) {
+      ramp_position = target;
+      ramp_velocity = 0;
+    }
+
+    window_sum += ramp_velocity - window[head];
+    window[head] = ramp_velocity;
+    head = head + 1 == window_size ? 0 : head + 1;
+
+    float new_vel = window_sum / window_size;
+    acceleration = (new_vel - velocity) / dt;
+    velocity = new_vel;
+    position += velocity * dt;
+
+    if (ramp_velocity == 0 && ramp_position == target &&
+        std::fabs(window_sum) < step_acc * dt) {
+      position = target;
+      stop();
+    }
+  }
+
+  float position = 0, velocity = 0, acceleration = 0;
+
+private:
+  static float clamp(float value, float min, float max) noexcept {
+    return std::fmin(std::fmax(value, min), max);
+  }
+
+  float dt;
+  float target = 0;
+  float vel_limit = 0, acc_limit = 0;
+  float ramp_position = 0, ramp_velocity = 0;
+  std::array<float, max_window> window{};
+  float window_sum = 0;
+  uint8_t window_size = 1, head = 0;
+  bool moving = false;
+};
@@ -3,6 +3,7 @@
 #include <avr/io.h>
 #include <limits>
 
+#include "fixed.hpp"
 #include "set_reg.hpp"
 
 inline void init_pwm() {
@@ -12,12 +13,15 @@ inline void init_pwm() {
   TCCR1B = setmask(CS12, WGM12, WGM13);
 }
 
-inline void pwm_set(float f) {
-  uint16_t value = f * std::numeric_limits<uint16_t>::max();
+inline void pwm_set(uint16_t value) {
   TCNT1L = value & 0x00ff;
   TCNT1H = value & 0xff00;
 }
 
+inline void pwm_set(float f) {
+  pwm_set(uint16_t(f * std::numeric_limits<uint16_t>::max()));
+}
+
 inline void setA(bool value) {
   if (value)
     TCCR1A |= setmask(COM1A1);
@@ -46,26 +50,38 @@ inline void pinB(bool value) {
     PORTD &= clearmask(PORTD5);
 }
 
-inline void set_motor(float value) {
-  if (value == 0) {
+inline void set_motor(bool forward, uint16_t duty) {
+  if (duty == 0) {
     setA(false);
     setB(false);
     pinA(false);
     pinB(false);
     return;
   }
-  if (value > 0) {
-    pwm_set(value);
+  pwm_set(duty);
+  if (forward) {
     setA(true);
     setB(false);
     pinA(false);
     pinB(true);
 
   } else {
-    pwm_set(-value);
     setA(false);
     setB(true);
     pinA(true);
     pinB(false);
   }
 }
+
+inline void set_motor(float value) {
+  float magnitude = value > 0 ? value : -value;
+  set_motor(value > 0,
+            uint16_t(magnitude * std::numeric_limits<uint16_t>::max()));
+}
+
+// What the current loop drives with, 1.0 is full on. No float math, since
+// this is every tick.
+inline void set_motor(q16_16 value) {
+  uint32_t magnitude = value.raw < 0 ? -int64_t(value.raw) : value.raw;
+  set_motor(value.raw > 0, magnitude > 0xffff ? 0xffff : magnitude);
+}
@@ -0,0 +1,389 @@
+#pragma once
+
+#include <array>
+#include <avr/pgmspace.h>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+#include "i2c.hpp"
+
+// Where a register's read goes, straight into its spot in a response image.
+struct ResponseWriter {
+  uint8_t *at;
+  void push_back(uint8_t byte) noexcept { *at++ = byte; }
+};
+
+template <typename T>
+inline void push_value(ResponseWriter &out, T value) noexcept {
+  auto bytes = std::bit_cast<std::array<uint8_t, sizeof(T)>>(value);
+  memcpy(out.at, bytes.data(), sizeof(T));
+  out.at += sizeof(T);
+}
+
+template <typename T> inline T pop_value(buffer_span &buffer) noexcept {
+  std::array<uint8_t, sizeof(T)> data;
+  for (uint8_t &b : data) {
+    b = buffer.pop_front();
+  }
+  return std::bit_cast<T>(data);
+}
+
+template <typename Device> struct Register {
+  // for writes that check their own length
+  static constexpr uint8_t any_size = 0xff;
+
+  uint8_t address;
+  // what read pushes, exactly
+  uint8_t read_size;
+  // writes of any other length are dropped before they get to write
+  uint8_t write_size;
+  void (*read)(Device &, ResponseWriter &);
+  void (*write)(Device &, buffer_span &);
+  // Instead of read, for registers that can't be rendered ahead of time. Runs
+  // in the TWI interrupt, and isn't part of any other register's burst.
+  std::span<uint8_t const> (*serve)(Device &);
+  // rendered every tick, instead of taking turns with the rest
+  bool live = false;
+  // Instead of read, for a register that's just other registers back to
+  // back, their addresses. See gather.
+  std::array<uint8_t, 5> parts{};
+
+  constexpr bool readable() const noexcept { return read || parts[0] != 0; }
+};
+
+namespace register_impl {
+template <typename> struct member_of;
+template <typename T, typename C> struct member_of<T C::*> {
+  using type = C;
+};
+template <auto Member>
+using device_of = typename member_of<decltype(Member)>::type;
+} // namespace register_impl
+
+// The type, and so the length, comes from what the getter returns.
+template <auto Get>
+consteval Register<register_impl::device_of<Get>> read_only(uint8_t address) {
+  using Device = register_impl::device_of<Get>;
+  using T = decltype((std::declval<Device &>().*Get)());
+  return {address, sizeof(T), 0,
+          [](Device &device, ResponseWriter &out) {
+            push_value(out, (device.*Get)());
+          },
+          nullptr};
+}
+
+template <auto Get, auto Set>
+consteval Register<register_impl::device_of<Get>> read_write(uint8_t address) {
+  using Device = register_impl::device_of<Get>;
+  using T = decltype((std::declval<Device &>().*Get)());
+  static_assert(std::is_invocable_v<decltype(Set), Device &, T>,
+                "the setter has to take what the getter returns");
+  return {address, sizeof(T), sizeof(T),
+          [](Device &device, ResponseWriter &out) {
+            push_value(out, (device.*Get)());
+          },
+          [](Device &device, buffer_span &in) {
+            (device.*Set)(pop_value<T>(in));
+          }};
+}
+
+// For registers that change every tick, so reads of them stay one tick old.
+template <typename Device>
+consteval Register<Device> live(Register<Device> entry) {
+  entry.live = true;
+  return entry;
+}
+
+// A live register made of the bytes of live registers before it, copied out
+// of the image once they're rendered instead of worked out again. Since they
+// all render in the same tick, it's one consistent sample of them.
+template <typename Device, size_t M>
+consteval Register<Device> gather(uint8_t address, char const (&parts)[M]) {
+  static_assert(M - 1 <= std::tuple_size_v<decltype(Register<Device>::parts)>,
+                "too many parts");
+  Register<Device> entry{address, 0, 0, nullptr, nullptr, nullptr, true};
+  for (size_t i = 0; i + 1 < M; i++) {
+    entry.parts[i] = parts[i];
+  }
+  return entry;
+}
+
+// Read responses, laid out in table order and rendered ahead of time, so the
+// TWI interrupt only ever sends bytes. A read starting at any register carries
+// on into the ones after it. There are two copies: reads start on the
+// published one while the loop fills in the other.
+template <size_t Size> struct ResponseImage {
+  static constexpr uint8_t none = 0xff;
+
+  std::span<uint8_t const> respond(uint8_t offset) noexcept {
+    sending = published;
+    return std::span(copies[published]).subspan(offset);
+  }
+
+  std::array<std::array<uint8_t, Size>, 2> copies{};
+  volatile uint8_t published = 0;
+  // the copy the last read started on
+  volatile uint8_t sending = none;
+  // the next of the registers that take turns
+  uint8_t cursor = 0;
+  // the one that took its turn in the published copy, and still has to be
+  // carried over into the other
+  uint8_t carried = none;
+};
+
+// A batch write is {address, value} pairs for any registers with a fixed
+// write size, all applied together.
+constexpr uint8_t batch_address = 'z';
+
+// Turns a register table into a lookup by address and the layout of the read
+// responses. The whole thing lives in flash, so it has to be declared PROGMEM.
+template <typename Device, size_t N> class RegisterMap {
+public:
+  static constexpr uint8_t none = 0xff;
+
+  consteval explicit RegisterMap(std::array<Register<Device>, N> const &table)
+      : entries(table) {
+    if (N >= none)
+      throw "too many registers";
+    index.fill(none);
+    size_t offset = 0;
+    for (uint8_t i = 0; i != N; i++) {
+      Register<Device> &entry = entries[i];
+      if (entry.address == 0 || entry.address >= index.size())
+        throw "register addresses are ASCII";
+      if (entry.address == batch_address)
+        throw "that address is for batch writes";
+      if (index[entry.address] != none)
+        throw "register declared twice";
+      if (entry.parts[0] != 0) {
+        if (entry.read || !entry.live)
+          throw "a gathered register is live and has no read of its own";
+        for (uint8_t part : entry.parts) {
+          if (part == 0)
+            break;
+          uint8_t j = part < index.size() ? index[part] : none;
+          if (j == none || !entries[j].read || !entries[j].live)
+            throw "gathered parts have to be live and come before";
+          entry.read_size += entries[j].read_size;
+        }
+      }
+      if (!entry.readable() && !entry.write && !entry.serve)
+        throw "register can't be read or written";
+      if (entry.readable() && entry.serve)
+        throw "register is either rendered or served";
+      if (entry.readable() && entry.read_size == 0)
+        throw "readable register needs a size";
+      if (entry.write && (entry.write_size == 0 ||
+                          (entry.write_size != Register<Device>::any_size &&
+                           entry.write_size > buffer_span::capacity())))
+        throw "write doesn't fit in the I2C buffer";
+      index[entry.address] = i;
+      offsets[i] = offset;
+      if (entry.readable())
+        offset += entry.read_size;
+    }
+    if (offset >= 0x100)
+      throw "responses don't fit in 255 bytes";
+    size = offset;
+    // live ones first, then the ones that take turns
+    for (uint8_t i = 0; i != N; i++) {
+      if (entries[i].readable() && entries[i].live)
+        order[live_count++] = i;
+    }
+    uint8_t rendered = live_count;
+    for (uint8_t i = 0; i != N; i++) {
+      if (entries[i].readable() && !entries[i].live)
+        order[rendered++] = i;
+    }
+    turn_count = rendered - live_count;
+  }
+
+  constexpr size_t image_size() const noexcept { return size; }
+  static constexpr size_t count() noexcept { return N; }
+
+  void write(Device &device, uint8_t address, buffer_span &in) const noexcept {
+    uint8_t i = lookup(address);
+    if (i == none)
+      return;
+    Register<Device> entry = load(i);
+    if (!entry.write || (entry.write_size != Register<Device>::any_size &&
+                         in.size() != entry.write_size))
+      return;
+    entry.write(device, in);
+  }
+
+  // Checks the whole batch before applying any of it.
+  bool write_batch(Device &device, buffer_span &in) const noexcept {
+    uint8_t size = in.size();
+    for (uint8_t at = 0; at != size;) {
+      uint8_t i = lookup(in[at]);
+      if (i == none)
+        return false;
+      Register<Device> entry = load(i);
+      if (!entry.write || entry.write_size == Register<Device>::any_size ||
+          size - at - 1 < entry.write_size)
+        return false;
+      at += 1 + entry.write_size;
+    }
+    // each write takes its own bytes straight out of in, without a copy
+    while (!in.empty()) {
+      Register<Device> entry = load(lookup(in.pop_front()));
+      uint8_t after = in.size() - entry.write_size;
+      entry.write(device, in);
+      while (in.size() > after) {
+        in.pop_front();
+      }
+    }
+    return true;
+  }
+
+  // For the TWI interrupt, the bytes from a register on, or nothing if it
+  // can't be read.
+  template <size_t Size>
+  std::span<uint8_t const> read(Device &device, uint8_t address,
+                                ResponseImage<Size> &image) const noexcept {
+    uint8_t i = lookup(address);
+    if (i == none)
+      return {};
+    Register<Device> entry = load(i);
+    if (entry.serve)
+      return entry.serve(device);
+    if (!entry.readable())
+      return {};
+    return image.respond(pgm_read_byte(&offsets[i]));
+  }
+
+  // Renders every live register and the next of the rest straight into the
+  // copy reads aren't starting on, and publishes it. The rest take turns to
+  // keep the float math per tick down, and the one whose turn it was last
+  // time is copied over from the published copy, so both copies keep up.
+  // Reading says if a read is still going, which could be out of the copy
+  // that isn't published anymore.
+  template <size_t Size>
+  void render_step(Device &device, ResponseImage<Size> &image,
+                   bool reading) const noexcept {
+    uint8_t back = image.published ^ 1;
+    if (reading && image.sending == back)
+      return;
+    std::array<uint8_t, Size> &copy = image.copies[back];
+    if (image.carried != image.none) {
+      uint8_t i = image.carried;
+      uint8_t offset = pgm_read_byte(&offsets[i]);
+      uint8_t size = pgm_read_byte(&entries[i].read_size);
+      if (offset + size <= Size)
+        memcpy(&copy[offset], &image.copies[image.published][offset], size);
+    }
+    uint8_t lives = pgm_read_byte(&live_count);
+    uint8_t turns = pgm_read_byte(&turn_count);
+    for (uint8_t k = 0; k != lives; k++) {
+      render(device, copy, pgm_read_byte(&order[k]));
+    }
+    image.carried = image.none;
+    if (turns != 0) {
+      uint8_t i = pgm_read_byte(&order[lives + image.cursor]);
+      render(device, copy, i);
+      image.carried = i;
+      if (++image.cursor == turns)
+        image.cursor = 0;
+    }
+    // the copy has to be done before the flip
+    asm volatile("" ::: "memory");
+    image.published = back;
+  }
+
+private:
+  template <size_t Size>
+  void render(Device &device, std::array<uint8_t, Size> &copy,
+              uint8_t i) const noexcept {
+    Register<Device> entry = load(i);
+    uint8_t offset = pgm_read_byte(&offsets[i]);
+    if (offset + entry.read_size > Size)
+      return;
+    if (entry.read) {
+      ResponseWriter out{&copy[offset]};
+      entry.read(device, out);
+      return;
+    }
+    for (uint8_t part : entry.parts) {
+      if (part == 0)
+        break;
+      uint8_t j = lookup(part);
+      uint8_t size = pgm_read_byte(&entries[j].read_size);
+      memcpy(&copy[offset], &copy[pgm_read_byte(&offsets[j])], size);
+      offset += size;
+    }
+  }
+
+  uint8_t lookup(uint8_t address) const noexcept {
+    return address < index.size() ? pgm_read_byte(&index[address]) : none;
+  }
+  Register<Device> load(uint8_t i) const noexcept {
+    Register<Device> entry;
+    memcpy_P(&entry, &entries[i], sizeof(entry));
+    return entry;
+  }
+
+  std::array<uint8_t, 128> index{};
+  std::array<Register<Device>, N> entries;
+  std::array<uint8_t, N> offsets{};
+  // indices of the readable registers, live ones first
+  std::array<uint8_t, N> order{};
+  uint8_t live_count = 0, turn_count = 0;
+  size_t size = 0;
+};
+
+template <typename T, size_t A, size_t B>
+consteval std::array<T, A + B> join(std::array<T, A> const &a,
+                                    std::array<T, B> const &b) {
+  std::array<T, A + B> result{};
+  for (size_t i = 0; i != A; i++) {
+    result[i] = a[i];
+  }
+  for (size_t i = 0; i != B; i++) {
+    result[A + i] = b[i];
+  }
+  return result;
+}
+
+// Everything both DeviceState and MockDevice have, in burst order. The live
+// ones are everything that moves on its own.
+template <typename Device>
+consteval std::array<Register<Device>, 16> device_registers() {
+  return {
+      live(read_only<&Device::get_angle>('x')),
+      live(read_only<&Device::get_vel>('v')),
+      live(read_only<&Device::get_current>('a')),
+      // a profiled move walks the setpoint along
+      live(read_write<&Device::get_setpoint, &Device::set_setpoint>('s')),
+      // the new mode goes last, after the setpoint it starts with
+      live(Register<Device>{
+          'm', sizeof(typename Device::Mode), sizeof(float) + 1,
+          [](Device &device, ResponseWriter &out) {
+            push_value(out, device.get_mode());
+          },
+          [](Device &device, buffer_span &in) {
+            float setpoint = pop_value<float>(in);
+            uint8_t mode = in.pop_front();
+            if (mode > Device::current)
+              return;
+            device.transition_state(typename Device::Mode(mode), setpoint);
+          }}),
+      read_write<&Device::get_P, &Device::set_P>('p'),
+      read_write<&Device::get_I, &Device::set_I>('i'),
+      read_write<&Device::get_D, &Device::set_D>('d'),
+      read_write<&Device::get_F, &Device::set_F>('f'),
+      gather<Device>('b', "xvasm"),
+      // the compact bank: 16 bit fixed point instead of floats, see README
+      live(read_only<&Device::get_angle_fixed>('X')),
+      live(read_only<&Device::get_vel_fixed>('V')),
+      live(read_only<&Device::get_current_raw>('A')),
+      live(read_write<&Device::get_setpoint_fixed,
+                      &Device::set_setpoint_fixed>('S')),
+      gather<Device>('B', "XVASm"),
+      live(read_only<&Device::get_turns>('u')),
+  };
+}
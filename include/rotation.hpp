@@ -4,17 +4,46 @@
 #include "set_reg.hpp"
 
 #include <array>
+#include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/sfr_defs.h>
 #include <bit>
 #include <cstdint>
 
-inline void init_spi() noexcept {
+// SCK as a fraction of the CPU clock
+struct SpiClock {
+  uint8_t spcr;
+  uint8_t spsr;
+};
+
+consteval SpiClock spi_clock(uint8_t divider) {
+  switch (divider) {
+  case 2:
+    return {0, _BV(SPI2X)};
+  case 4:
+    return {0, 0};
+  case 8:
+    return {_BV(SPR0), _BV(SPI2X)};
+  case 16:
+    return {_BV(SPR0), 0};
+  case 32:
+    return {_BV(SPR1), _BV(SPI2X)};
+  case 64:
+    return {_BV(SPR1), 0};
+  case 128:
+    return {_BV(SPR1) | _BV(SPR0), 0};
+  default:
+    throw "SCK can only be the CPU clock over 2, 4, 8, 16, 32, 64 or 128";
+  }
+}
+
+inline void init_spi(SpiClock clock = spi_clock(4)) noexcept {
   PORTB |= _BV(PORT2);
   DDRB |= setmask(DDB2, DDB3, DDB4, DDB5);
 
   // CPOL, CPHA
-  SPCR = setmask(SPE, MSTR);
+  SPCR = setmask(SPE, MSTR) | clock.spcr;
+  SPSR = clock.spsr;
 }
 
 enum struct ReadAddr : uint8_t {};
@@ -51,11 +80,19 @@ struct TmagPacket {
   }
 };
 
+// the command bit that starts a conversion in trigger mode
+constexpr uint8_t start_conversion = 0x1;
+
 struct TmagReturn {
   uint8_t status2;
   uint16_t data;
-  uint8_t status1 : 4;
+  // same layout as TmagPacket's last byte, crc goes in the low bits
   uint8_t crc : 4;
+  uint8_t status1 : 4;
+
+  // Moves on with every conversion, so the same count twice means the data
+  // hasn't changed.
+  constexpr uint8_t set_count() const noexcept { return status1 & 0x7; }
 };
 
 constexpr uint32_t byteswap(uint32_t i) {
@@ -67,7 +104,54 @@ constexpr uint16_t byteswap(uint16_t i) {
   return ((i & 0x00ff) << 8) | ((i & 0xff00) >> 8);
 }
 
+namespace spi_impl {
+inline std::array<uint8_t, 4> out{}, in{};
+// the next byte to come in, all of them means there's nothing going
+inline volatile uint8_t at = 4;
+} // namespace spi_impl
+
+// Shifts the next byte out as soon as the last one is in, and lets go of the
+// chip select after the last.
+ISR(SPI_STC_vect) {
+  using namespace spi_impl;
+  uint8_t i = at;
+  in[i] = SPDR;
+  if (++i != in.size()) {
+    SPDR = out[i];
+  } else {
+    PORTB |= setmask(PORT2);
+    SPCR &= clearmask(SPIE);
+  }
+  at = i;
+}
+
+inline bool spi_done() noexcept { return spi_impl::at == spi_impl::in.size(); }
+
+// Starts a transaction and returns straight away, the SPI interrupt does the
+// rest. Interrupts have to be on for it to finish.
+inline void spi_begin(auto input) noexcept {
+  while (!spi_done()) {
+  }
+  spi_impl::out = std::bit_cast<std::array<uint8_t, 4>>(input);
+  spi_impl::at = 0;
+  PORTB &= clearmask(PORT2);
+  SPCR |= setmask(SPIE);
+  SPDR = spi_impl::out[0];
+}
+
+// What the last spi_begin got back, waiting for it if it isn't done yet.
+inline TmagReturn spi_result() noexcept {
+  while (!spi_done()) {
+  }
+  // the bytes are only all in once at says so
+  asm volatile("" ::: "memory");
+  return std::bit_cast<TmagReturn>(spi_impl::in);
+}
+
 inline TmagReturn spi_transaction(auto input) noexcept {
+  // an interrupt driven one would still have the bus
+  while (!spi_done()) {
+  }
   std::array<uint8_t, 4> result = {};
   std::array<uint8_t, 4> in = std::bit_cast<std::array<uint8_t, 4>>(input);
   // I hate spinlock implementations. I am too lazy to bother trying something
@@ -91,7 +175,25 @@ inline TmagReturn read_raw(ReadAddr addr) noexcept {
 
 inline uint16_t get_sys_stat() noexcept { return read_raw(0xe_r).data; }
 
-inline uint16_t get_angle() noexcept { return byteswap(read_raw(0x13_r).data); }
+// Every angle read starts the next conversion, so in trigger mode there's a
+// new sample by the next read if they're far enough apart.
+inline uint16_t get_angle() noexcept {
+  return byteswap(spi_transaction(TmagPacket(0x13_r, start_conversion)).data);
+}
+
+struct TmagAngle {
+  uint16_t angle;
+  uint8_t set_count;
+};
+
+// get_angle split in two, so something else can run while it's on the bus
+inline void start_angle() noexcept {
+  spi_begin(TmagPacket(0x13_r, start_conversion));
+}
+inline TmagAngle finish_angle() noexcept {
+  TmagReturn result = spi_result();
+  return {byteswap(result.data), result.set_count()};
+}
 
 inline uint16_t get_mag() noexcept { return read_raw(0x14_r).data; }
 
@@ -151,15 +253,17 @@ struct [[gnu::packed]] TmagSensorConfig {
 inline void init_tmag() noexcept {
   TmagDeviceConfig settings{
       .magnet_tempco = MagnetType::NdBFe,
+      .conv_avg = 1,
       .temp_ch_enable = true,
-      .op_mode = OpMode::continuous,
+      .op_mode = OpMode::trigger,
   };
-  // runs a conversion every 50 ms
+  // Converts once per angle read. X, Y and the temperature at 2x averaging
+  // are well under a millisecond, so one started on a control tick is done
+  // by the next.
   TmagSensorConfig sensor{
-      .sleeptime = 6,
       .angle_en = Axis::xy,
   };
-  sensor.set_magnet_ch(0xf);
+  sensor.set_magnet_ch(0x3);
   spi_transaction(byteswap(uint32_t(0x0f000407)));
   auto result0 = spi_transaction(TmagPacket(0x0d_r));
   auto result1 = spi_transaction(TmagPacket(0x01_w, sensor));
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "timer.hpp"
+
+struct Task {
+  // gets the time the tick started, see timebase::now()
+  void (*run)(uint32_t now) noexcept;
+  // in control ticks
+  uint8_t period;
+  // which tick in the period it runs on, to keep slow tasks apart
+  uint8_t offset;
+  // microseconds after the start of the tick it has to be done by
+  uint16_t deadline;
+};
+
+struct TaskStats {
+  uint16_t worst_us = 0;
+  uint16_t misses = 0;
+};
+
+// Runs a fixed table of tasks off of the control tick. Tasks run to
+// completion in table order with interrupts on, and the CPU sleeps once
+// everything due in a tick is done.
+template <size_t N> class Scheduler {
+public:
+  consteval explicit Scheduler(std::array<Task, N> const &table)
+      : tasks(table) {
+    for (uint8_t i = 0; i != N; i++) {
+      if (tasks[i].period == 0 || tasks[i].offset >= tasks[i].period)
+        throw "offset has to be within a nonzero period";
+      countdown[i] = tasks[i].offset + 1;
+    }
+  }
+
+  void run(uint32_t tick_start) noexcept {
+    for (uint8_t i = 0; i != N; i++) {
+      if (--countdown[i] != 0)
+        continue;
+      countdown[i] = tasks[i].period;
+      uint32_t start = timebase::now();
+      tasks[i].run(tick_start);
+      uint32_t end = timebase::now();
+      uint16_t took = timebase::elapsed(start, end);
+      if (took > stats[i].worst_us)
+        stats[i].worst_us = took;
+      if (timebase::elapsed(tick_start, end) > tasks[i].deadline)
+        ++stats[i].misses;
+    }
+  }
+
+  // needs init_control_tick first
+  [[noreturn]] void loop() noexcept {
+    while (true) {
+      wait_control_tick();
+      uint32_t now = timebase::now();
+      sei();
+      run(now);
+    }
+  }
+
+  static constexpr size_t size() noexcept { return N; }
+
+  std::array<TaskStats, N> stats{};
+
+private:
+  std::array<Task, N> tasks;
+  std::array<uint8_t, N> countdown{};
+};
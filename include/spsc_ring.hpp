@@ -0,0 +1,97 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+// A ring for handing data between the interrupt and the loop, bytes unless
+// it's given something else to hold. Indices are a byte each and run free,
+// wrapping at 256, and only get masked down to the capacity when they're
+// used, so full and empty can be told apart without a separate count. The
+// producer only moves head and the consumer only moves tail, so either side
+// can be an interrupt without the other turning them off. Anything the
+// producer reads of tail, or the consumer of head, can only be out of date in
+// the safe direction.
+template <uint8_t Capacity, typename T = uint8_t> class SpscRing {
+  static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0 &&
+                    Capacity <= 128,
+                "indices wrap at 256, so the capacity has to divide it");
+  static constexpr uint8_t mask = Capacity - 1;
+
+public:
+  static constexpr uint8_t capacity() noexcept { return Capacity; }
+
+  // Whatever the consumer reads after checking these is already in.
+  uint8_t size() const noexcept {
+    uint8_t count = head - tail;
+    asm volatile("" ::: "memory");
+    return count;
+  }
+  bool empty() const noexcept { return size() == 0; }
+  bool full() const noexcept { return size() == Capacity; }
+
+  // producer side
+
+  // Doesn't overwrite anything, a value that doesn't fit is dropped.
+  bool push_back(T value) noexcept {
+    uint8_t at = head;
+    if (uint8_t(at - tail) == Capacity)
+      return false;
+    items[at & mask] = value;
+    publish(at + 1);
+    return true;
+  }
+
+  // As much of data as fits, and how much that was. The consumer sees all of
+  // it at once.
+  uint8_t push(std::span<T const> data) noexcept {
+    uint8_t at = head;
+    uint8_t count = Capacity - uint8_t(at - tail);
+    if (data.size() < count)
+      count = data.size();
+    for (uint8_t i = 0; i != count; i++) {
+      items[at++ & mask] = data[i];
+    }
+    publish(at);
+    return count;
+  }
+
+  // consumer side
+
+  // Only on a ring that isn't empty.
+  T front() const noexcept { return items[tail & mask]; }
+  T operator[](uint8_t i) const noexcept {
+    return items[uint8_t(tail + i) & mask];
+  }
+  T pop_front() noexcept {
+    uint8_t at = tail;
+    T value = items[at & mask];
+    tail = at + 1;
+    return value;
+  }
+
+  // Fills as much of out as there is for, and says how much that was.
+  uint8_t pop(std::span<T> out) noexcept {
+    uint8_t at = tail;
+    uint8_t count = size();
+    if (out.size() < count)
+      count = out.size();
+    for (uint8_t i = 0; i != count; i++) {
+      out[i] = items[at++ & mask];
+    }
+    tail = at;
+    return count;
+  }
+
+  void clear() noexcept { tail = head; }
+
+private:
+  void publish(uint8_t at) noexcept {
+    // the values have to be in before the consumer can see them
+    asm volatile("" ::: "memory");
+    head = at;
+  }
+
+  std::array<T, Capacity> items{};
+  volatile uint8_t head = 0, tail = 0;
+};
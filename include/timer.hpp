@@ -6,58 +6,168 @@
 #include <avr/sleep.h>
 #include <cstdint>
 
+// Everything time related runs off of timer2, which free runs and is never
+// reset. Compare A paces the control loop and compare B wakes sleeps up on
+// time, so timer0 is left free.
+namespace timebase {
+constexpr uint32_t prescaler = 8;
+constexpr uint32_t cycles_per_tick = prescaler;
+static_assert(prescaler * 1000000 % F_CPU == 0,
+              "timer2 ticks have to be whole microseconds");
+// 8 at 1 MHz, so times are in microseconds but only 8 us apart
+constexpr uint32_t us_per_tick = prescaler * 1000000 / F_CPU;
+} // namespace timebase
+
 namespace timer_impl {
-inline uint8_t ticks = 0;
-inline uint8_t remainder = 0;
+inline volatile uint32_t overflows = 0;
+inline volatile uint8_t control_ticks = 0;
+inline uint8_t seen_ticks = 0;
+inline uint8_t control_period = 0;
+inline uint16_t overruns = 0;
+} // namespace timer_impl
 
-struct tick_count {
-  consteval tick_count(uint32_t ms) {
-    ticks = float(ms) / 1000 * F_CPU / 256 / 1024;
-    remainder = (ticks - ticks) * 256;
-  }
-  constexpr tick_count() = default;
-  constexpr tick_count(uint16_t t, uint8_t r) : ticks(t), remainder(r) {}
-  uint16_t ticks;
-  uint8_t remainder;
-};
+// every 256 ticks, or 2048 us at 1 MHz
+ISR(TIMER2_OVF_vect) { timer_impl::overflows = timer_impl::overflows + 1; }
 
-} // namespace timer_impl
+// Moving the compare point along instead of resetting the timer means ticks
+// stay on a fixed phase no matter how late this gets serviced.
+ISR(TIMER2_COMPA_vect) {
+  OCR2A = OCR2A + timer_impl::control_period;
+  timer_impl::control_ticks = timer_impl::control_ticks + 1;
+}
+
+// only there to wake sleep_until up
+EMPTY_INTERRUPT(TIMER2_COMPB_vect);
+
+inline void init_timer() {
+  TCCR2A = 0;
+  TCCR2B = setmask(CS21);
+  TIMSK2 |= setmask(TOIE2);
+}
 
-// triggers every 256 * 1024 cycles, or 16 ms at 16Mhz
-ISR(TIMER0_COMPA_vect) {
-  ++timer_impl::ticks;
-  TCNT0 = 0;
+namespace timebase {
+// timer2 ticks since init_timer
+inline uint32_t ticks() noexcept {
+  uint8_t sreg = SREG;
+  cli();
+  uint32_t overflows = timer_impl::overflows;
+  uint8_t count = TCNT2;
+  // an overflow that hasn't been serviced yet
+  if (bit_is_set(TIFR2, TOV2) && count != 0xff)
+    ++overflows;
+  SREG = sreg;
+  return (overflows << 8) | count;
 }
 
-// works until about 1074790.4 ms aka about 12 days
-// surely you would not delay for over 12 days right?
-inline void sleep_ms(timer_impl::tick_count ms) {
-  auto &[tick_time, remainder] = ms;
-  timer_impl::ticks = 0;
-  OCR0A = 0xff;
-  TIMSK0 |= setmask(OCIE0A);
+// wraps after 2^32 cycles, about 71 minutes at 1 MHz
+inline uint32_t cycles() noexcept { return ticks() * cycles_per_tick; }
+// same wrap as cycles
+inline uint32_t now() noexcept { return ticks() * us_per_tick; }
+
+// These all survive the wrap, as long as the two times are less than 2^31
+// microseconds apart.
+constexpr uint32_t elapsed(uint32_t since, uint32_t until) noexcept {
+  return until - since;
+}
+inline uint32_t elapsed(uint32_t since) noexcept {
+  return elapsed(since, now());
+}
+constexpr bool reached(uint32_t time, uint32_t at) noexcept {
+  return int32_t(time - at) >= 0;
+}
+
+struct Deadline {
+  uint32_t at;
+
+  static Deadline in(uint32_t us) noexcept { return {now() + us}; }
+  bool expired() const noexcept { return reached(now(), at); }
+  uint32_t remaining() const noexcept {
+    int32_t left = at - now();
+    return left < 0 ? 0 : left;
+  }
+};
+
+inline void sleep_until(Deadline deadline) noexcept {
+  uint8_t sreg = SREG;
   while (true) {
     cli();
-    if (timer_impl::ticks >= tick_time) {
+    uint32_t left = deadline.remaining() / us_per_tick;
+    if (left == 0)
       break;
+    // otherwise the overflow wakes us up soon enough to check again
+    if (left < 0x100) {
+      OCR2B = TCNT2 + left;
+      TIFR2 = setmask(OCF2B);
+      TIMSK2 |= setmask(OCIE2B);
     }
     sleep_enable();
     sei();
     sleep_cpu();
     sleep_disable();
   }
-  OCR0A = remainder;
-  TCNT0 = 0;
-  while (true) {
-    cli();
-    if (timer_impl::ticks != 0)
-      break;
+  TIMSK2 &= clearmask(OCIE2B);
+  SREG = sreg;
+}
+} // namespace timebase
+
+inline void sleep_us(uint32_t us) {
+  timebase::sleep_until(timebase::Deadline::in(us));
+}
+
+// works until about 4294967 ms aka about 71 minutes
+inline void sleep_ms(uint32_t ms) { sleep_us(ms * 1000); }
+
+struct control_period {
+  consteval control_period(uint32_t us) : ticks(us / timebase::us_per_tick) {
+    if (us % timebase::us_per_tick != 0)
+      throw "period has to be a whole number of timer2 ticks";
+    if (ticks == 0 || ticks > 0xff)
+      throw "period doesn't fit in timer2";
+  }
+  uint32_t ticks;
+};
+
+// Needs init_timer first.
+inline void init_control_tick(control_period period) {
+  uint8_t sreg = SREG;
+  cli();
+  timer_impl::control_period = period.ticks;
+  timer_impl::seen_ticks = timer_impl::control_ticks;
+  OCR2A = TCNT2 + period.ticks;
+  TIFR2 = setmask(OCF2A);
+  TIMSK2 |= setmask(OCIE2A);
+  SREG = sreg;
+}
+
+// Sleeps until the next control tick, and returns with interrupts disabled.
+// If a tick already went by while the last update was still running, that's
+// an overrun, and we wait for the next one to stay in phase.
+inline void wait_control_tick() {
+  cli();
+  timer_impl::overruns +=
+      uint8_t(timer_impl::control_ticks - timer_impl::seen_ticks);
+  timer_impl::seen_ticks = timer_impl::control_ticks;
+  while (timer_impl::control_ticks == timer_impl::seen_ticks) {
     sleep_enable();
     sei();
     sleep_cpu();
     sleep_disable();
+    cli();
   }
-  TIMSK0 &= clearmask(OCIE0A);
+  timer_impl::seen_ticks = timer_impl::control_ticks;
 }
 
-inline void init_timer() { TCCR0B |= setmask(CS02, CS00); }
+inline uint16_t control_overruns() noexcept { return timer_impl::overruns; }
+
+// The number of the tick that's running, counting up from whenever.
+inline uint8_t control_tick() noexcept { return timer_impl::seen_ticks; }
+
+// Starts the control period over from now, so the next tick comes a whole
+// period later and whatever would have come before that doesn't. For lining
+// ticks up with something every servo sees at the same time. Only from an
+// interrupt or with them off, and returns the number the next tick gets.
+inline uint8_t restart_control_tick() noexcept {
+  OCR2A = TCNT2 + timer_impl::control_period;
+  TIFR2 = setmask(OCF2A);
+  return timer_impl::control_ticks + 1;
+}
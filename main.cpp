@@ -5,135 +5,263 @@
 #include <cmath>
 #include <util/delay.h>
 
+#include "command_queue.hpp"
 #include "current.hpp"
 #include "device.hpp"
 #include "i2c.hpp"
+#include "probe.hpp"
 #include "pwm.hpp"
+#include "registers.hpp"
 #include "rotation.hpp"
+#include "scheduler.hpp"
 #include "timer.hpp"
 
 namespace {
 constexpr uint8_t ipropi_pin = 0;
 constexpr uint8_t divider_pin = 1;
-constexpr float get_float(auto &buffer) {
-  std::array<uint8_t, 4> data;
-  for (uint8_t i = 0; i != 4; i++) {
-    data[i] = buffer[i];
-  }
-  return std::bit_cast<float>(data);
+DeviceState state;
+
+void apply_writes(uint32_t) noexcept;
+// the angle comes in over SPI while the ADC converts
+void acquire(uint32_t now) noexcept {
+  start_angle();
+  state.set_current(
+      probed(Stage::adc, [] { return get_analog_raw(ipropi_pin); }));
+  TmagAngle angle = probed(Stage::spi, [] { return finish_angle(); });
+  probed(Stage::observer,
+         [=] { state.update_loc(angle.angle, angle.set_count, now); });
+}
+void position_loop(uint32_t now) noexcept {
+  probed(Stage::position, [=] { state.run_position(now); });
 }
+void velocity_loop(uint32_t now) noexcept {
+  probed(Stage::velocity, [=] { state.run_velocity(now); });
+}
+void current_loop(uint32_t now) noexcept {
+  q16_16 output =
+      probed(Stage::current, [=] { return state.run_current(now); });
+  state.publish();
+  probed(Stage::motor, [=] { set_motor(output); });
+}
+void render_responses(uint32_t) noexcept;
 
-bool checkFloat(auto &buf) { return buf.size() != sizeof(float); }
+// Table order is run order within a tick. Position is offset by a tick so it
+// never lands on the same tick as velocity.
+auto scheduler = Scheduler(std::array{
+    Task{apply_writes, 1, 0, 400},
+    Task{acquire, 1, 0, 1000},
+    Task{position_loop, DeviceState::position_divider, 1, 1800},
+    Task{velocity_loop, DeviceState::velocity_divider, 0, 1800},
+    Task{current_loop, 1, 0, DeviceState::tick_us},
+    Task{render_responses, 1, 0, DeviceState::tick_us},
+});
 
-constexpr void push_float(auto &buffer, float f) {
-  auto data = std::bit_cast<std::array<uint8_t, 4>>(f);
-  for (uint8_t b : data) {
-    buffer.push_back(b);
-  }
-}
+// Reads are laid out in table order, and carry on into the registers after
+// the one they start at.
+constexpr RegisterMap registers PROGMEM = RegisterMap(join(
+    device_registers<DeviceState>(),
+    std::array{
+        Register<DeviceState>{'o', sizeof(uint16_t), 0,
+                              [](DeviceState &, ResponseWriter &out) {
+                                push_value(out, control_overruns());
+                              },
+                              nullptr},
+        Register<DeviceState>{'w', scheduler.size() * sizeof(TaskStats), 0,
+                              [](DeviceState &, ResponseWriter &out) {
+                                for (TaskStats const &stats :
+                                     scheduler.stats) {
+                                  push_value(out, stats.worst_us);
+                                  push_value(out, stats.misses);
+                                }
+                              },
+                              nullptr},
+#ifndef NDEBUG
+        Register<DeviceState>{'c', probe_stats_size, 0,
+                              [](DeviceState &, ResponseWriter &out) {
+                                push_probe_stats(out);
+                              },
+                              nullptr},
+        Register<DeviceState>{'h', sizeof(uint16_t), 0,
+                              [](DeviceState &, ResponseWriter &out) {
+                                push_value(out, stack_headroom());
+                              },
+                              nullptr},
+#endif
+        // {loop, source, first index}, then {x, P, I, D} per point
+        Register<DeviceState>{
+            'g', 0, Register<DeviceState>::any_size, nullptr,
+            [](DeviceState &device, buffer_span &in) {
+              constexpr uint8_t point_size = 4 * sizeof(float);
+              if (in.size() < 3 || (in.size() - 3) % point_size != 0)
+                return;
+              auto loop = DeviceState::Mode(in.pop_front());
+              auto source = DeviceState::Schedule::Source(in.pop_front());
+              uint8_t index = in.pop_front();
+              if (loop > DeviceState::current ||
+                  source > DeviceState::Schedule::setpoint)
+                return;
+              while (!in.empty()) {
+                float x = pop_value<float>(in);
+                float p = pop_value<float>(in);
+                float i = pop_value<float>(in);
+                float d = pop_value<float>(in);
+                device.set_schedule_point(loop, index++, x, p, i, d);
+              }
+              device.set_schedule(loop, source, index);
+            }},
+        // {target, max velocity, max acceleration, optional max jerk}
+        Register<DeviceState>{
+            't', 0, Register<DeviceState>::any_size, nullptr,
+            [](DeviceState &device, buffer_span &in) {
+              if (in.size() != 3 * sizeof(float) &&
+                  in.size() != 4 * sizeof(float))
+                return;
+              float target = pop_value<float>(in);
+              float max_vel = pop_value<float>(in);
+              float max_acc = pop_value<float>(in);
+              float max_jerk = in.empty() ? 0 : pop_value<float>(in);
+              device.start_move(target, max_vel, max_acc, max_jerk);
+            }},
+        // a setpoint, or a move like t, for the next broadcast latch
+        Register<DeviceState>{
+            'n', 0, Register<DeviceState>::any_size, nullptr,
+            [](DeviceState &device, buffer_span &in) {
+              if (in.size() == sizeof(float)) {
+                device.stage_setpoint(pop_value<float>(in));
+                return;
+              }
+              if (in.size() != 3 * sizeof(float) &&
+                  in.size() != 4 * sizeof(float))
+                return;
+              float target = pop_value<float>(in);
+              float max_vel = pop_value<float>(in);
+              float max_acc = pop_value<float>(in);
+              float max_jerk = in.empty() ? 0 : pop_value<float>(in);
+              device.stage_move(target, max_vel, max_acc, max_jerk);
+            }},
+        // {alpha, beta, gamma, acceleration per current}
+        Register<DeviceState>{
+            'e', 3 + sizeof(float), 3 + sizeof(float),
+            [](DeviceState &device, ResponseWriter &out) {
+              Observer::Gains const &gains = device.get_observer();
+              out.push_back(gains.alpha);
+              out.push_back(gains.beta);
+              out.push_back(gains.gamma);
+              constexpr float per_tick_squared =
+                  float(DeviceState::ticks_per_second) *
+                  DeviceState::ticks_per_second;
+              push_value(out,
+                         gains.accel_per_current.to_float() * per_tick_squared);
+            },
+            [](DeviceState &device, buffer_span &in) {
+              uint8_t alpha = in.pop_front();
+              uint8_t beta = in.pop_front();
+              uint8_t gamma = in.pop_front();
+              device.set_observer(alpha, beta, gamma, pop_value<float>(in));
+            }},
+        // {trigger, decimation}
+        Register<DeviceState>{'k', 0, 2, nullptr,
+                              [](DeviceState &device, buffer_span &in) {
+                                auto trigger =
+                                    DeviceState::Recorder::Trigger(
+                                        in.pop_front());
+                                device.set_capture(trigger, in.pop_front());
+                              }},
+        Register<DeviceState>{'r', 0, 0, nullptr, nullptr,
+                              [](DeviceState &device) {
+                                return device.drain_capture();
+                              }},
+    }));
 
-DeviceState state;
+ResponseImage<registers.image_size()> responses;
+CommandQueue<128> commands;
+// A broadcast latch restarts the control tick at its stop condition, which
+// every servo sees at once, and applies at the start of the tick after that.
+volatile bool latch_pending = false;
+volatile uint8_t latch_tick = 0;
+
+// Writes only get queued here, nothing the loops use changes under them.
 auto i2c = I2c(
-    [](uint8_t addr, auto &output) {
-      switch (addr) {
-      case 'p':
-        if (checkFloat(output))
-          break;
-        state.set_P(get_float(output));
-        break;
-      case 'i':
-        if (checkFloat(output))
-          break;
-        state.set_I(get_float(output));
-        break;
-      case 'd':
-        if (checkFloat(output))
-          break;
-        state.set_D(get_float(output));
-        break;
-      case 'f':
-        if (checkFloat(output))
-          break;
-        state.set_F(get_float(output));
-        break;
-      case 's':
-        if (checkFloat(output))
-          break;
-        state.set_setpoint(get_float(output));
-        break;
-      case 'm': {
-        if (output.size() != sizeof(float) + 1)
-          break;
-        uint8_t mode = output.pop_back();
-        float setpoint = get_float(output);
-        state.transition_state(DeviceState::Mode(mode), setpoint);
-        break;
-      }
-      default:;
-      }
-      while (!output.empty()) {
-        output.pop_back();
+    [](uint8_t addr, buffer_span &output, bool general) {
+      if (general && addr == 'l') {
+        latch_tick = restart_control_tick();
+        latch_pending = true;
+      } else {
+        commands.push(addr, output, general);
       }
     },
-    [](uint8_t addr, auto &input) {
-      switch (addr) {
-      case 'p':
-        push_float(input, state.get_P());
-        break;
-      case 'i':
-        push_float(input, state.get_I());
-        break;
-      case 'd':
-        push_float(input, state.get_D());
-        break;
-      case 'f':
-        push_float(input, state.get_F());
-        break;
-      case 's':
-        push_float(input, state.get_setpoint());
-        break;
-      case 'm': {
-        input.push_back(state.get_mode());
-        break;
-      }
-      case 'x': {
-        push_float(input, state.get_angle());
-      }
-      case 'v': {
-        push_float(input, state.get_vel());
-      }
-      case 'a': {
-        push_float(input, state.get_current());
-      }
-      default:
-        input.push_back(0xff);
-      }
-    });
+    [](uint8_t addr) { return registers.read(state, addr, responses); });
+
+// General calls, the same frame goes to every servo on the bus.
+void broadcast(uint8_t command, buffer_span &data) noexcept {
+  switch (command) {
+  case 's': {
+    // {node address, setpoint} for each servo, everyone picks out their own
+    constexpr uint8_t entry_size = 1 + sizeof(float);
+    if (data.size() % entry_size != 0)
+      break;
+    uint8_t self = i2c_address();
+    while (!data.empty()) {
+      uint8_t node = data.pop_front();
+      float setpoint = pop_value<float>(data);
+      if (node == self)
+        state.set_setpoint(setpoint);
+    }
+    break;
+  }
+  default:;
+  }
+}
+
+// before anything else in the tick, so every loop sees all of the writes
+void apply_writes(uint32_t) noexcept {
+  commands.drain([](uint8_t addr, buffer_span &data, bool general) {
+    if (general)
+      broadcast(addr, data);
+    else if (addr == batch_address)
+      registers.write_batch(state, data);
+    else
+      registers.write(state, addr, data);
+  });
+  // a tick can be skipped as an overrun, so not just the one it was for
+  cli();
+  bool due = latch_pending && int8_t(control_tick() - latch_tick) >= 0;
+  if (due)
+    latch_pending = false;
+  sei();
+  if (due)
+    state.latch();
+}
+
+// the live registers every tick, and one of the rest
+void render_responses(uint32_t) noexcept {
+  registers.render_step(state, responses, i2c.responding);
+}
 } // namespace
 
 ISR(TWI_vect) {
   I2cStatus stat = static_cast<I2cStatus>(TWSR);
-  if (i2c._serve(stat))
+  if (probed(Stage::twi, [=] { return i2c._serve(stat); }))
     i2c_ack();
   else
     i2c_nack();
 }
 
 int main() {
+#ifndef NDEBUG
+  paint_stack();
+#endif
   init_spi();
   init_tmag();
   init_adc();
   init_pwm();
   init_timer();
+  // only starts the first conversion, turns count from the first one that's
+  // done, see DeviceState::update_loc
   state.update_loc(get_angle());
+  state.start(timebase::now());
   init_i2c();
+  init_control_tick(DeviceState::tick_us);
   sei();
-  while (true) {
-    sleep_ms(20);
-    cli();
-    state.update_loc(get_angle());
-    state.set_current(get_analog(ipropi_pin));
-    set_motor(state.get_output());
-    sei();
-  }
+  scheduler.loop();
 }
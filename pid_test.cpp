@@ -0,0 +1,101 @@
+#include "pid_controller.hpp"
+#include "pid.hpp"
+#include "set_reg.hpp"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <cstdio>
+#include <util/delay.h>
+
+// Compares the cycles MiniPID and FixedPID take per getOutput call.
+// Timer1 runs unprescaled, so every count is a single cycle.
+namespace {
+constexpr uint8_t samples = 64;
+
+struct Stats {
+  uint16_t worst = 0;
+  uint32_t total = 0;
+  void add(uint16_t cycles) {
+    if (cycles > worst)
+      worst = cycles;
+    total += cycles;
+  }
+  void print(const char *name) {
+    printf("%s: worst %u, mean %u cycles\n", name, worst,
+           uint16_t(total / samples));
+  }
+};
+
+template <typename F> uint16_t count_cycles(F &&f) {
+  cli();
+  TCNT1 = 0;
+  f();
+  uint16_t cycles = TCNT1;
+  sei();
+  return cycles;
+}
+
+// something vaguely like a servo homing in on 90 degrees
+float actual(uint8_t i) { return 90.0f - 90.0f / (1 + i); }
+
+volatile float float_sink;
+volatile int32_t fixed_sink;
+} // namespace
+
+int main() {
+  TCCR1A = 0;
+  TCCR1B = setmask(CS10);
+  sei();
+  printf("hello world!\n");
+
+  while (true) {
+    MiniPID mini(0.01, 0.001, 0.002, 0.0);
+    mini.setOutputLimits(1);
+    mini.setOutputRampRate(0.1);
+    mini.setOutputFilter(0.1);
+    mini.setSetpoint(90);
+
+    FixedPID<q16_16> q16(0.01, 0.001, 0.002, 0.0);
+    q16.set_output_limits(q16_16(1.0f));
+    q16.set_output_ramp_rate(q16_16(0.1f));
+    q16.set_output_filter(q16_16(0.1f));
+    q16.set_setpoint(q16_16(90.0f));
+
+    // Q15 needs normalized inputs, so angles are scaled down by 360
+    FixedPID<q15> q(0.5, 0.05, 0.1, 0.0);
+    q.set_output_limits(q15(0.99f));
+    q.set_output_ramp_rate(q15(0.1f));
+    q.set_output_filter(q15(0.1f));
+    q.set_setpoint(q15(0.25f));
+
+    // what DeviceState runs, without the features it never turns on
+    PidController<q16_16, pid::output_limits, pid::integral_limit> lean(
+        0.01, 0.001, 0.002, 0.0);
+    lean.set_output_limits(q16_16(1.0f));
+    lean.set_setpoint(q16_16(90.0f));
+
+    // MiniPID works in per tick units, this is only about cycles
+    const q16_16 dt16 = q16_16(0.02f);
+    const q15 dt15 = q15(0.02f);
+
+    Stats mini_stats, q16_stats, q15_stats, lean_stats;
+    for (uint8_t i = 0; i != samples; i++) {
+      float a = actual(i);
+      q16_16 a16 = q16_16(a);
+      q15 a15 = q15(a / 360);
+      mini_stats.add(count_cycles([&] { float_sink = mini.getOutput(a); }));
+      q16_stats.add(
+          count_cycles([&] { fixed_sink = q16.get_output(a16, dt16).raw; }));
+      q15_stats.add(
+          count_cycles([&] { fixed_sink = q.get_output(a15, dt15).raw; }));
+      lean_stats.add(
+          count_cycles([&] { fixed_sink = lean.get_output(a16, dt16).raw; }));
+    }
+    mini_stats.print("MiniPID");
+    q16_stats.print("FixedPID<q16_16>");
+    q15_stats.print("FixedPID<q15>");
+    lean_stats.print("DeviceState PID");
+    printf("sizes: MiniPID %u, FixedPID<q16_16> %u, DeviceState PID %u\n",
+           sizeof(mini), sizeof(q16), sizeof(lean));
+    _delay_ms(1000);
+  }
+}